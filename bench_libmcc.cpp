@@ -0,0 +1,83 @@
+#include "mcc.h"
+
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// 测试libmcc在1..N个线程下每秒能编译多少个文件
+///
+/// 用法: bench_libmcc [每轮编译次数] [最大线程数] [-O0..-O3]
+/// 源码是生成的, 每个文件的函数名和常量不同, 形状与example.c类似
+
+static std::string generateSource(unsigned index)
+{
+    std::string n = std::to_string(index);
+    return "#include <stdio.h>\n"
+           "#include <stdlib.h>\n"
+           "static int table_" + n + "[64];\n"
+           "int sum_" + n + "(int *a, int len) {\n"
+           "    int s = 0;\n"
+           "    for (int i = 0; i < len; ++i)\n"
+           "        s += a[i] * " + n + ";\n"
+           "    return s;\n"
+           "}\n"
+           "int main() {\n"
+           "    int *p = malloc(sizeof(int) * 64);\n"
+           "    for (int i = 0; i < 64; ++i)\n"
+           "        p[i] = table_" + n + "[i] + i;\n"
+           "    printf(\"%d\\n\", sum_" + n + "(p, 64));\n"
+           "    free(p);\n"
+           "    return 0;\n"
+           "}\n";
+}
+
+int main(int argc, char **argv)
+{
+    unsigned compiles = argc > 1 ? std::stoul(argv[1]) : 1000;
+    unsigned maxThreads = argc > 2 ? std::stoul(argv[2]) : std::thread::hardware_concurrency();
+    mcc::CompileOptions options;
+    options.optLevel = argc > 3 && argv[3][0] == '-' && argv[3][1] == 'O' ? argv[3][2] - '0' : 2;
+    options.emitModule = false;
+    options.emitObject = true;
+
+    std::vector<std::string> sources;
+    for (unsigned i = 0; i < compiles; ++i)
+        sources.push_back(generateSource(i));
+
+    // 预热: 系统头文件进入共享文件缓存, 目标初始化完成
+    mcc::compile(sources[0], options);
+
+    llvm::outs() << llvm::format("%8s %12s %14s\n", "threads", "seconds", "compiles/s");
+    for (unsigned threads = 1; threads <= std::max(maxThreads, 1u); ++threads)
+    {
+        std::atomic<unsigned> next{0};
+        std::atomic<unsigned> failed{0};
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; ++t)
+        {
+            workers.emplace_back([&] {
+                for (unsigned i = next++; i < compiles; i = next++)
+                {
+                    if (!mcc::compile(sources[i], options).success)
+                        ++failed;
+                }
+            });
+        }
+        for (std::thread &worker : workers)
+            worker.join();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        llvm::outs() << llvm::format("%8u %12.3f %14.1f\n", threads, seconds, compiles / seconds);
+        if (failed > 0)
+        {
+            llvm::errs() << failed << " compiles failed\n";
+            return 1;
+        }
+    }
+    return 0;
+}
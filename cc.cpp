@@ -2,126 +2,2724 @@
 #include "llvm/Support/CommandLine.h"
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <cstring>
+#include <sstream>
 
+#include <clang/AST/ASTConsumer.h>
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/Decl.h>
+#include <clang/AST/GlobalDecl.h>
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/DiagnosticIDs.h>
 #include <clang/Basic/DiagnosticOptions.h>
+#include <clang/Basic/SourceManager.h>
 #include <clang/CodeGen/CodeGenAction.h>
+#include <clang/CodeGen/ModuleBuilder.h>
 #include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/FrontendAction.h>
+#include <clang/Frontend/FrontendActions.h>
 #include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Lex/HeaderSearch.h>
+#include <clang/Lex/Preprocessor.h>
 #include <clang/Lex/PreprocessorOptions.h>
+#include <clang/Serialization/InMemoryModuleCache.h>
+#include <clang/Serialization/PCHContainerOperations.h>
+#include <clang/Tooling/DependencyScanning/DependencyScanningService.h>
+#include <clang/Tooling/DependencyScanning/DependencyScanningTool.h>
+#include <clang/Tooling/JSONCompilationDatabase.h>
 
+#include <llvm/ADT/SetVector.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/Statistic.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/Module.h>
+#include <llvm/LTO/LTO.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/StandardInstrumentations.h>
+#include <llvm/Remarks/Remark.h>
+#include <llvm/Remarks/RemarkFormat.h>
+#include <llvm/Remarks/RemarkParser.h>
+#include <llvm/Support/Caching.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/FormatVariadic.h>
 #include <llvm/Support/Host.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/Path.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/TimeProfiler.h>
+#include <llvm/Support/xxhash.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <malloc.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "file-cache.h"
+#include "system-includes.h"
 
 std::string getCursorKindName(CXCursorKind cursorKind)
 {
-    CXString kindName = clang_getCursorKindSpelling(cursorKind);
-    std::string result = clang_getCString(kindName);
+    CXString kindName = clang_getCursorKindSpelling(cursorKind);
+    std::string result = clang_getCString(kindName);
+
+    clang_disposeString(kindName);
+    return result;
+}
+
+std::string getCursorSpelling(CXCursor cursor)
+{
+    CXString cursorSpelling = clang_getCursorSpelling(cursor);
+    std::string result = clang_getCString(cursorSpelling);
+
+    clang_disposeString(cursorSpelling);
+    return result;
+}
+
+CXChildVisitResult prettyPrintAst(CXCursor cursor, CXCursor /* parent */, CXClientData clientData)
+{
+    CXSourceLocation location = clang_getCursorLocation(cursor);
+    if (clang_Location_isFromMainFile(location) == 0)
+        return CXChildVisit_Continue;
+
+    CXCursorKind cursorKind = clang_getCursorKind(cursor);
+
+    unsigned int curLevel = *(reinterpret_cast<unsigned int *>(clientData));
+    unsigned int nextLevel = curLevel + 1;
+
+    std::cout << std::string(curLevel, '-') << " " << getCursorKindName(cursorKind) << " (" << getCursorSpelling(cursor) << ")\n";
+
+    clang_visitChildren(cursor,
+                        prettyPrintAst,
+                        &nextLevel);
+
+    return CXChildVisit_Continue;
+}
+
+using namespace llvm;
+
+/// 命令行选项
+///
+/// 第一个参数是模式(--emit-ir等), 之后是选项和输入文件
+struct Options
+{
+    std::string mode;
+    std::vector<std::string> inputs;
+    /// --emit-bc时写入ThinLTO summary
+    bool thinlto = false;
+    /// 并行度, 0表示使用全部核心
+    unsigned jobs = 0;
+    /// ThinLTO增量缓存目录, 为空表示不缓存
+    std::string thinltoCache;
+    /// 结束时打印共享文件缓存的计数
+    bool vfsStats = false;
+    /// 流式生成ir的输出目录, 为空表示一次性打印整个模块
+    std::string streamDir;
+    /// 峰值常驻内存上限(MB), 0表示不限制
+    uint64_t maxRSSMB = 0;
+    /// 优化级别, -O0到-O3
+    unsigned optLevel = 0;
+    /// -march=, -mcpu=, -mattr=, native表示本机的cpu和特性
+    std::string march;
+    std::string mcpu;
+    std::string mattr;
+    /// 优化记录(yaml)的输出路径, 以及按pass名过滤的正则表达式
+    std::string remarksFile;
+    std::string remarksFilter;
+    /// 编译后按函数汇总向量化和内联决定
+    bool remarksSummary = false;
+    /// 按函数缓存优化结果的目录, 为空表示不使用增量优化
+    std::string incrementalDir;
+    /// 以json输出LLVM的Statistic计数和pass耗时
+    bool statsJSON = false;
+    bool timePassesJSON = false;
+    /// --emit-sema/--emit-ast/--emit-tokens保存和加载语法树的目录, 为空表示每次都重新解析
+    std::string astCacheDir;
+    /// --scan-deps的编译数据库(compile_commands.json)和输出格式(make或json)
+    std::string compileDB;
+    std::string depsFormat = "make";
+    /// --check的诊断格式(json或sarif), 以及每个文件最多报告的错误数, 0表示不限制
+    std::string diagFormat = "json";
+    unsigned maxErrors = 0;
+    /// 按阶段报告每个翻译单元的内存使用
+    bool memReport = false;
+    /// --check并行时所有文件的估计内存之和的上限(MB), 0表示不限制
+    uint64_t memBudgetMB = 0;
+    /// 预编译头文件, 由--build-pch生成
+    std::string includePCH;
+    /// 在源文件前包含的头文件, 只在--bench-pch比较不使用PCH的情况时设置
+    std::string forceInclude;
+};
+
+/// 同一进程内所有翻译单元共享的文件缓存
+static SharedFileCache &sharedFileCache()
+{
+    static SharedFileCache cache;
+    return cache;
+}
+
+static void printUsage()
+{
+    std::cout << "Usage: " << std::endl;
+    std::cout << "    --emit-sema c语言文件名" << std::endl;
+    std::cout << "    --emit-tokens c语言文件名" << std::endl;
+    std::cout << "    --emit-ast c语言文件名" << std::endl;
+    std::cout << "    以上三种模式可以加--ast-cache=目录, 保存解析好的语法树, 源文件和头文件都没变时直接加载" << std::endl;
+    std::cout << "    --emit-ir [--stream=目录] [--max-rss=MB] c语言文件名" << std::endl;
+    std::cout << "    --emit-bc [--thinlto] c语言文件名" << std::endl;
+    std::cout << "    --check [-j N] [--diag-format=json|sarif] [--max-errors=N] [--mem-budget=MB] c语言文件名...  只做语法和语义检查" << std::endl;
+    std::cout << "    --scan-deps [-j N] [--compile-db=compile_commands.json] [--deps-format=make|json] [c语言文件名...]" << std::endl;
+    std::cout << "    --bench-deps [--compile-db=compile_commands.json] [c语言文件名...]  比较依赖扫描和完整解析的耗时" << std::endl;
+    std::cout << "    --thinlto-link [-j N] [--thinlto-cache=目录] bitcode文件..." << std::endl;
+    std::cout << "    --build-pch 头文件  生成头文件.pch(--emit-ir/--emit-bc/--check使用)和头文件.libclang.pch(libclang模式使用)" << std::endl;
+    std::cout << "    --bench-pch 头文件 c语言文件名...  比较每个文件使用和不使用PCH时的前端耗时" << std::endl;
+    std::cout << "    --include-pch=头文件.pch  所有模式都可以使用" << std::endl;
+    std::cout << "可以一次给出多个c语言文件, 它们共享同一个文件缓存; 文件名为-时从标准输入读取源码" << std::endl;
+    std::cout << "    --vfs-stats  结束时打印文件缓存节省的stat次数和字节数" << std::endl;
+    std::cout << "    -O0..-O3  优化级别" << std::endl;
+    std::cout << "    -march=native|cpu -mcpu=native|cpu -mattr=+特性,-特性  目标cpu和特性" << std::endl;
+    std::cout << "    --remarks=文件.yaml [--remarks-filter=正则] [--remarks-summary]  记录优化决定" << std::endl;
+    std::cout << "    --incremental=目录  只能和--emit-ir -O1一起使用, 按函数缓存优化后的ir, 只重新优化改动过的函数" << std::endl;
+    std::cout << "    --mem-report  在标准错误上按阶段报告每个文件的内存使用" << std::endl;
+    std::cout << "    --stats=json --time-passes=json  每个文件写出<文件名>.stats.json, 多个文件时另有汇总mcc.stats.json" << std::endl;
+}
+
+static bool parseOptions(int argc, char **argv, Options &opts)
+{
+    opts.mode = argv[1];
+    for (int i = 2; i < argc; ++i)
+    {
+        StringRef arg = argv[i];
+        if (arg == "--thinlto")
+            opts.thinlto = true;
+        else if (arg.consume_front("--thinlto-cache="))
+            opts.thinltoCache = arg.str();
+        else if (arg == "--vfs-stats")
+            opts.vfsStats = true;
+        else if (arg.consume_front("-march="))
+            opts.march = arg.str();
+        else if (arg.consume_front("-mcpu="))
+            opts.mcpu = arg.str();
+        else if (arg.consume_front("-mattr="))
+            opts.mattr = arg.str();
+        else if (arg.size() == 3 && arg.startswith("-O") && arg[2] >= '0' && arg[2] <= '3')
+            opts.optLevel = arg[2] - '0';
+        else if (arg.consume_front("--remarks="))
+            opts.remarksFile = arg.str();
+        else if (arg.consume_front("--remarks-filter="))
+            opts.remarksFilter = arg.str();
+        else if (arg == "--remarks-summary")
+            opts.remarksSummary = true;
+        else if (arg == "--stats=json")
+            opts.statsJSON = true;
+        else if (arg == "--time-passes=json")
+            opts.timePassesJSON = true;
+        else if (arg.consume_front("--compile-db="))
+            opts.compileDB = arg.str();
+        else if (arg.consume_front("--deps-format="))
+        {
+            if (arg != "make" && arg != "json")
+            {
+                std::cerr << "Unknown dependency format: " << argv[i] << std::endl;
+                return false;
+            }
+            opts.depsFormat = arg.str();
+        }
+        else if (arg.consume_front("--diag-format="))
+        {
+            if (arg != "json" && arg != "sarif")
+            {
+                std::cerr << "Unknown diagnostic format: " << argv[i] << std::endl;
+                return false;
+            }
+            opts.diagFormat = arg.str();
+        }
+        else if (arg.consume_front("--max-errors="))
+        {
+            if (arg.getAsInteger(10, opts.maxErrors))
+            {
+                std::cerr << "Invalid error limit: " << argv[i] << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--mem-report")
+            opts.memReport = true;
+        else if (arg.consume_front("--mem-budget="))
+        {
+            if (arg.getAsInteger(10, opts.memBudgetMB))
+            {
+                std::cerr << "Invalid memory budget: " << argv[i] << std::endl;
+                return false;
+            }
+        }
+        else if (arg.consume_front("--include-pch="))
+            opts.includePCH = arg.str();
+        else if (arg.consume_front("--ast-cache="))
+            opts.astCacheDir = arg.str();
+        else if (arg.consume_front("--incremental="))
+            opts.incrementalDir = arg.str();
+        else if (arg.consume_front("--stream="))
+            opts.streamDir = arg.str();
+        else if (arg.consume_front("--max-rss="))
+        {
+            if (arg.getAsInteger(10, opts.maxRSSMB))
+            {
+                std::cerr << "Invalid memory limit: " << argv[i] << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "-")
+            opts.inputs.push_back(arg.str());
+        else if (arg == "-j" && i + 1 < argc)
+        {
+            if (StringRef(argv[++i]).getAsInteger(10, opts.jobs))
+            {
+                std::cerr << "Invalid job count: " << argv[i] << std::endl;
+                return false;
+            }
+        }
+        else if (arg.consume_front("-j"))
+        {
+            if (arg.getAsInteger(10, opts.jobs))
+            {
+                std::cerr << "Invalid job count: " << argv[i] << std::endl;
+                return false;
+            }
+        }
+        else if (arg.startswith("-"))
+        {
+            std::cerr << "Unknown option: " << argv[i] << std::endl;
+            return false;
+        }
+        else
+            opts.inputs.push_back(arg.str());
+    }
+    // 增量模式只运行函数级的简化流水线, -O2以上的内联、向量化和模块级优化都不会运行
+    if (!opts.incrementalDir.empty() && opts.optLevel != 1)
+    {
+        std::cerr << "--incremental runs only the per-function simplification pipeline and requires -O1." << std::endl;
+        return false;
+    }
+    if (!opts.incrementalDir.empty() && opts.mode != "--emit-ir")
+    {
+        std::cerr << "--incremental can only be used with --emit-ir." << std::endl;
+        return false;
+    }
+    if (!opts.streamDir.empty() && opts.optLevel > 0)
+    {
+        std::cerr << "--stream writes unoptimized ir and cannot be combined with -O1..-O3." << std::endl;
+        return false;
+    }
+    if (opts.inputs.empty() && opts.compileDB.empty())
+    {
+        std::cerr << "No input files." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// 输出文件放在当前目录, 文件名取输入文件名并替换扩展名, 与clang -c的行为一致
+static std::string outputPathFor(StringRef input, StringRef extension)
+{
+    SmallString<128> path(sys::path::filename(input));
+    sys::path::replace_extension(path, extension);
+    return std::string(path);
+}
+
+/// 并行处理时的内存准入控制: 正在处理的文件的估计内存加上下一个文件的估计超过预算时, 下一个文件等待
+///
+/// 估计值 = 文件大小 × 已完成文件中观察到的最大(前端内存/文件大小). 还没有文件完成时估计值取整个预算,
+/// 即一次只处理一个文件. 没有其它文件在处理时总会放行, 单个文件超过预算也不会卡住.
+class MemoryBudget
+{
+public:
+    MemoryBudget(uint64_t budgetBytes, std::vector<uint64_t> fileSizes)
+        : budget(budgetBytes), fileSizes(std::move(fileSizes)) {}
+
+    /// 阻塞直到可以开始处理第index个文件, 返回为它预留的字节数
+    uint64_t acquire(size_t index)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        uint64_t estimate = 0;
+        available.wait(lock, [&] {
+            estimate = measured ? static_cast<uint64_t>(ratio * std::max<uint64_t>(fileSizes[index], 1)) : budget;
+            return inUse == 0 || inUse + estimate <= budget;
+        });
+        inUse += estimate;
+        return estimate;
+    }
+
+    void release(uint64_t reserved)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        inUse -= reserved;
+        available.notify_all();
+    }
+
+    /// 记录第index个文件实际使用的内存, 更新之后的估计
+    void record(size_t index, uint64_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ratio = std::max(ratio, static_cast<double>(bytes) / std::max<uint64_t>(fileSizes[index], 1));
+        measured = true;
+        available.notify_all();
+    }
+
+private:
+    const uint64_t budget;
+    const std::vector<uint64_t> fileSizes;
+    std::mutex mutex;
+    std::condition_variable available;
+    uint64_t inUse = 0;
+    double ratio = 0;
+    bool measured = false;
+};
+
+/// 用jobs个线程处理下标0..count-1, 每个线程从共享的计数器领取下一个下标, fn的第一个参数是线程编号
+/// 给出budget时, 每个下标开始前先经过内存准入控制
+static void runParallel(unsigned jobs, size_t count, function_ref<void(unsigned, size_t)> fn,
+                        MemoryBudget *budget = nullptr)
+{
+    std::atomic<size_t> next{0};
+    auto worker = [&](unsigned id) {
+        for (size_t i = next++; i < count; i = next++)
+        {
+            uint64_t reserved = budget ? budget->acquire(i) : 0;
+            fn(id, i);
+            if (budget)
+                budget->release(reserved);
+        }
+    };
+    if (jobs <= 1)
+    {
+        worker(0);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (unsigned id = 0; id < jobs; ++id)
+        threads.emplace_back(worker, id);
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+/// 代码生成的目标: triple、cpu和特性列表(+avx2这样的形式)
+struct TargetSelection
+{
+    std::string triple;
+    std::string cpu;
+    std::vector<std::string> features;
+};
+
+/// 根据-march/-mcpu/-mattr确定目标, native时探测本机的cpu和全部特性
+static TargetSelection selectTarget(const Options &opts)
+{
+    TargetSelection target;
+    target.triple = sys::getDefaultTargetTriple();
+    StringRef cpu = opts.mcpu.empty() ? opts.march : opts.mcpu;
+    if (cpu == "native")
+    {
+        target.triple = sys::getProcessTriple();
+        target.cpu = sys::getHostCPUName().str();
+        StringMap<bool> hostFeatures;
+        if (sys::getHostCPUFeatures(hostFeatures))
+        {
+            for (const auto &feature : hostFeatures)
+                target.features.push_back((feature.getValue() ? "+" : "-") + feature.getKey().str());
+            // StringMap的遍历顺序不固定, 排序后生成的ir才稳定
+            llvm::sort(target.features);
+        }
+    }
+    else
+        target.cpu = cpu.str();
+
+    SmallVector<StringRef, 8> attrs;
+    StringRef(opts.mattr).split(attrs, ',', -1, false);
+    for (StringRef attr : attrs)
+        target.features.push_back(attr.startswith("+") || attr.startswith("-") ? attr.str() : "+" + attr.str());
+    return target;
+}
+
+static CodeGenOpt::Level codeGenOptLevel(unsigned optLevel)
+{
+    switch (optLevel)
+    {
+    case 0:
+        return CodeGenOpt::None;
+    case 1:
+        return CodeGenOpt::Less;
+    case 3:
+        return CodeGenOpt::Aggressive;
+    default:
+        return CodeGenOpt::Default;
+    }
+}
+
+static std::unique_ptr<TargetMachine> createTargetMachine(const TargetSelection &target, unsigned optLevel)
+{
+    std::string error;
+    const Target *theTarget = TargetRegistry::lookupTarget(target.triple, error);
+    if (!theTarget)
+    {
+        errs() << target.triple << ": " << error << "\n";
+        return nullptr;
+    }
+    return std::unique_ptr<TargetMachine>(theTarget->createTargetMachine(
+        target.triple, target.cpu, join(target.features, ","), TargetOptions(), Reloc::PIC_,
+        None, codeGenOptLevel(optLevel)));
+}
+
+/// 优化记录文件的路径. 一次编译多个文件时在文件名中插入源文件名, 例如out.yaml -> out.example.yaml
+static std::string remarksPathFor(const Options &opts, StringRef file)
+{
+    if (opts.remarksFile.empty())
+        return outputPathFor(file, "opt.yaml");
+    if (opts.inputs.size() == 1)
+        return opts.remarksFile;
+    SmallString<128> path(opts.remarksFile);
+    std::string extension = sys::path::extension(path).str();
+    sys::path::replace_extension(path, sys::path::stem(file) + extension);
+    return std::string(path);
+}
+
+/// 一个函数的向量化和内联决定
+struct FunctionRemarks
+{
+    /// 一个没有向量化的循环: Missed在循环的位置, 原因是它之前的Analysis, 位置通常是出问题的指令
+    struct MissedLoop
+    {
+        std::string location;
+        std::vector<std::string> reasons;
+    };
+
+    unsigned vectorized = 0;
+    unsigned inlined = 0;
+    std::vector<MissedLoop> missedLoops;
+    /// 还没有遇到对应的Missed或Passed的Analysis
+    std::vector<std::string> pendingReasons;
+    std::vector<std::string> notInlined;
+};
+
+static std::string remarkLocation(const remarks::Remark &remark)
+{
+    if (!remark.Loc)
+        return "<unknown>";
+    return (remark.Loc->SourceFilePath + ":" + Twine(remark.Loc->SourceLine) + ":" +
+            Twine(remark.Loc->SourceColumn)).str();
+}
+
+/// 读取优化记录, 按函数打印向量化的循环数、未能向量化的原因和内联决定
+static void printRemarksSummary(StringRef path)
+{
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(path);
+    if (!buffer)
+    {
+        errs() << path << ": " << buffer.getError().message() << "\n";
+        return;
+    }
+    Expected<std::unique_ptr<remarks::RemarkParser>> parser =
+        remarks::createRemarkParser(remarks::Format::YAML, (*buffer)->getBuffer());
+    if (!parser)
+    {
+        errs() << path << ": " << toString(parser.takeError()) << "\n";
+        return;
+    }
+
+    std::map<std::string, FunctionRemarks> functions;
+    while (true)
+    {
+        Expected<std::unique_ptr<remarks::Remark>> next = (*parser)->next();
+        if (!next)
+        {
+            Error err = next.takeError();
+            if (err.isA<remarks::EndOfFileError>())
+                consumeError(std::move(err));
+            else
+                errs() << path << ": " << toString(std::move(err)) << "\n";
+            break;
+        }
+        const remarks::Remark &remark = **next;
+        FunctionRemarks &summary = functions[remark.FunctionName.str()];
+        std::string message = remarkLocation(remark) + ": " + remark.getArgsAsMsg();
+        if (remark.PassName == "loop-vectorize")
+        {
+            // LoopVectorize先报告原因(Analysis), 再对循环报告Missed或Passed.
+            // 每个没有向量化的循环只按Missed计数一次, 同一函数中它之前的Analysis都是它的原因
+            if (remark.RemarkType == remarks::Type::Passed)
+            {
+                ++summary.vectorized;
+                summary.pendingReasons.clear();
+            }
+            else if (remark.RemarkType == remarks::Type::Missed)
+            {
+                summary.missedLoops.push_back({remarkLocation(remark), std::move(summary.pendingReasons)});
+                summary.pendingReasons.clear();
+            }
+            else if (remark.RemarkType == remarks::Type::Analysis)
+                summary.pendingReasons.push_back(message);
+        }
+        else if (remark.PassName == "inline")
+        {
+            if (remark.RemarkType == remarks::Type::Passed)
+                ++summary.inlined;
+            else if (remark.RemarkType == remarks::Type::Missed)
+                summary.notInlined.push_back(message);
+        }
+    }
+
+    for (const auto &entry : functions)
+    {
+        const FunctionRemarks &summary = entry.second;
+        errs() << entry.first << ": " << summary.vectorized << " loops vectorized, "
+               << summary.missedLoops.size() << " not vectorized, "
+               << summary.inlined << " calls inlined, " << summary.notInlined.size() << " not inlined\n";
+        for (const FunctionRemarks::MissedLoop &loop : summary.missedLoops)
+        {
+            errs() << "    not vectorized: " << loop.location << (loop.reasons.empty() ? ": no reason given" : "")
+                   << "\n";
+            for (const std::string &reason : loop.reasons)
+                errs() << "        " << reason << "\n";
+        }
+        // 没有跟在循环之前的原因也打印出来, 不丢掉
+        for (const std::string &reason : summary.pendingReasons)
+            errs() << "    vectorization analysis: " << reason << "\n";
+        for (const std::string &message : summary.notInlined)
+            errs() << "    not inlined: " << message << "\n";
+    }
+}
+
+/// 生成传给CompilerInvocation的cc1参数
+static std::vector<std::string> buildCC1Args(const Options &opts, const std::string &file)
+{
+    std::vector<std::string> args = {file};
+    if (opts.mode == "--build-pch")
+        args.insert(args.end(), {"-x", "c-header", "-emit-pch", "-o", file + ".pch"});
+    if (!opts.includePCH.empty())
+    {
+        args.push_back("-include-pch");
+        args.push_back(opts.includePCH);
+    }
+    if (!opts.forceInclude.empty())
+    {
+        args.push_back("-include");
+        args.push_back(opts.forceInclude);
+    }
+    if (opts.optLevel > 0)
+        args.push_back("-O" + std::to_string(opts.optLevel));
+    // 增量模式由mcc逐个函数优化, clang只生成未优化的ir
+    if (!opts.incrementalDir.empty())
+        args.push_back("-disable-llvm-passes");
+
+    // clang会给每个函数加上target-cpu和target-features属性, 向量化和指令选择据此使用对应的指令集
+    TargetSelection target = selectTarget(opts);
+    args.push_back("-triple");
+    args.push_back(target.triple);
+    if (!target.cpu.empty())
+    {
+        args.push_back("-target-cpu");
+        args.push_back(target.cpu);
+    }
+    for (const std::string &feature : target.features)
+    {
+        args.push_back("-target-feature");
+        args.push_back(feature);
+    }
+    addSystemIncludes(target.triple, args);
+
+    // 优化记录由clang的后端写出. 没有调试信息时clang会自动加上位置跟踪, 所以记录中带有源码位置
+    if (!opts.remarksFile.empty() || opts.remarksSummary)
+    {
+        args.push_back("-opt-record-file");
+        args.push_back(remarksPathFor(opts, file));
+        args.push_back("-opt-record-format");
+        args.push_back("yaml");
+        if (!opts.remarksFilter.empty())
+        {
+            args.push_back("-opt-record-passes");
+            args.push_back(opts.remarksFilter);
+        }
+    }
+
+    // 出现这么多错误后clang报告fatal error并停止, 不再继续分析
+    if (opts.maxErrors > 0)
+    {
+        args.push_back("-ferror-limit");
+        args.push_back(std::to_string(opts.maxErrors));
+    }
+
+    if (opts.mode == "--emit-bc")
+    {
+        if (opts.thinlto)
+        {
+            // 与clang -flto=thin -c相同, BackendUtil会用ThinLTOBitcodeWriter写入summary
+            args.push_back("-flto=thin");
+        }
+        args.push_back("-o");
+        args.push_back(outputPathFor(file, "bc"));
+    }
+    return args;
+}
+
+/// 进程的峰值常驻内存(字节)
+static uint64_t peakRSSBytes()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    // Linux上ru_maxrss的单位是KB
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+}
+
+/// 当前的常驻内存. 峰值是整个进程的最高点, 一个大文件之后的所有文件和阶段都是同一个值,
+/// 按文件和阶段报告时要用当前值
+static uint64_t currentRSSBytes()
+{
+    // /proc/self/statm的第二列是常驻内存的页数
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size = 0, resident = 0;
+    if (!(statm >> size >> resident))
+        return 0;
+    return resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+}
+
+/// 一个翻译单元的内存使用报告, 按阶段记录
+struct MemoryReport
+{
+    struct Entry
+    {
+        std::string name;
+        uint64_t value;
+        bool bytes;
+    };
+    std::vector<Entry> entries;
+    /// 前端各部分内存之和, 用于并行时的内存准入控制
+    uint64_t frontendBytes = 0;
+
+    void addBytes(StringRef name, uint64_t value) { entries.push_back({name.str(), value, true}); }
+    void addCount(StringRef name, uint64_t value) { entries.push_back({name.str(), value, false}); }
+
+    /// 并行处理时各个文件的报告整块写出, 不会交错
+    void print(StringRef file) const
+    {
+        std::string text;
+        raw_string_ostream os(text);
+        os << file << ": memory report\n";
+        for (const Entry &entry : entries)
+        {
+            if (entry.bytes)
+                os << format("  %-40s %12.1f KB\n", entry.name.c_str(), entry.value / 1024.0);
+            else
+                os << format("  %-40s %12llu\n", entry.name.c_str(), static_cast<unsigned long long>(entry.value));
+        }
+        static std::mutex mutex;
+        std::lock_guard<std::mutex> lock(mutex);
+        errs() << os.str();
+    }
+};
+
+/// 前端各部分占用的内存, 分类与clang_getCXTUResourceUsage相同. Sema的数据结构都分配在ASTContext中, 计入AST
+static void addFrontendUsage(clang::CompilerInstance &ci, MemoryReport &report)
+{
+    size_t first = report.entries.size();
+    if (ci.hasASTContext())
+    {
+        clang::ASTContext &ctx = ci.getASTContext();
+        report.addBytes("AST", ctx.getASTAllocatedMemory());
+        report.addBytes("AST side tables", ctx.getSideTableAllocatedMemory());
+        report.addBytes("identifiers", ctx.Idents.getAllocator().getTotalMemory());
+        report.addBytes("selectors", ctx.Selectors.getTotalMemory());
+    }
+    if (ci.hasPreprocessor())
+    {
+        clang::Preprocessor &pp = ci.getPreprocessor();
+        report.addBytes("preprocessor", pp.getTotalMemory());
+        report.addBytes("header search", pp.getHeaderSearchInfo().getTotalMemory());
+    }
+    if (ci.hasSourceManager())
+    {
+        clang::SourceManager &sm = ci.getSourceManager();
+        clang::SourceManager::MemoryBufferSizes sizes = sm.getMemoryBufferSizes();
+        report.addBytes("source manager: malloc'd buffers", sizes.malloc_bytes);
+        report.addBytes("source manager: mmap'd buffers", sizes.mmap_bytes);
+        report.addBytes("source manager: data structures", sm.getDataStructureSizes());
+    }
+    for (size_t i = first; i < report.entries.size(); ++i)
+        report.frontendBytes += report.entries[i].value;
+}
+
+/// 包装另一个FrontendAction, 在前端结束、ASTContext释放之前记录内存使用
+///
+/// 不拥有被包装的action: 调用者的action在栈上, 析构时把所有权交还.
+class MemoryReportAction : public clang::WrapperFrontendAction
+{
+public:
+    MemoryReportAction(clang::FrontendAction &action, MemoryReport &report)
+        : WrapperFrontendAction(std::unique_ptr<clang::FrontendAction>(&action)), report(report) {}
+
+    ~MemoryReportAction() override { WrappedAction.release(); }
+
+protected:
+    void EndSourceFileAction() override
+    {
+        // 代码生成(以及--emit-bc的后端)在HandleTranslationUnit中已经完成
+        addFrontendUsage(getCompilerInstance(), report);
+        report.addBytes("RSS after frontend and codegen", currentRSSBytes());
+        WrapperFrontendAction::EndSourceFileAction();
+    }
+
+private:
+    MemoryReport &report;
+};
+
+/// 当前malloc分配出去的字节数, 包括直接mmap的大块
+static uint64_t mallocBytesInUse()
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+/// 连续编译多个翻译单元时复用的前端状态
+///
+/// FileManager记住已经查找过的路径, InMemoryModuleCache保存已经加载的PCH, 之后的翻译单元不再读取和映射PCH文件.
+/// 两者都不是线程安全的, 并行时每个线程一份, 底层共用线程安全的文件缓存.
+struct FrontendState
+{
+    IntrusiveRefCntPtr<clang::FileManager> fileManager;
+    IntrusiveRefCntPtr<clang::InMemoryModuleCache> moduleCache;
+
+    FrontendState()
+        : fileManager(new clang::FileManager(clang::FileSystemOptions(), sharedFileCache().vfs())),
+          moduleCache(new clang::InMemoryModuleCache()) {}
+};
+
+/// 串行编译时所有翻译单元共用的模块缓存, FileManager由sharedFileCache()提供
+static clang::InMemoryModuleCache &sharedModuleCache()
+{
+    static IntrusiveRefCntPtr<clang::InMemoryModuleCache> cache(new clang::InMemoryModuleCache());
+    return *cache;
+}
+
+/// 在CompilerInstance上对一个c文件执行FrontendAction
+///
+/// 默认诊断以文本打印到标准错误, 所有翻译单元共用一个FileManager和模块缓存.
+/// 并行时调用者传入自己的diagConsumer和state.
+static bool runFrontendAction(const Options &opts, const std::string &file, clang::FrontendAction &action,
+                              clang::DiagnosticConsumer *diagConsumer = nullptr,
+                              FrontendState *state = nullptr,
+                              MemoryReport *memoryReport = nullptr)
+{
+    // Setup custom diagnostic options.
+    IntrusiveRefCntPtr<clang::DiagnosticOptions> diag_opts(new clang::DiagnosticOptions());
+    diag_opts->ShowColors = 1;
+
+    // Setup custom diagnostic consumer.
+    //
+    // We configure the consumer with our custom diagnostic options and set it
+    // up that diagnostic messages are printed to stderr.
+    std::unique_ptr<clang::DiagnosticConsumer> diag_print;
+    if (!diagConsumer)
+    {
+        diag_print = std::make_unique<clang::TextDiagnosticPrinter>(llvm::errs(), diag_opts.get());
+        diagConsumer = diag_print.get();
+    }
+
+    // Create custom diagnostics engine.
+    //
+    // The engine will NOT take ownership of the DiagnosticConsumer object.
+    auto diag_eng = std::make_unique<clang::DiagnosticsEngine>(
+        nullptr /* DiagnosticIDs */, diag_opts, diagConsumer,
+        false /* own DiagnosticConsumer */);
+
+    // Create compiler instance.
+    //
+    // 已经加载过的PCH留在共享的模块缓存中, 不随CompilerInstance释放.
+    clang::CompilerInstance cc(std::make_shared<clang::PCHContainerOperations>(),
+                               state ? state->moduleCache.get() : &sharedModuleCache());
+
+    // Setup compiler invocation.
+    //
+    // The first argument is the file name of our code. The file is read
+    // through the shared file cache, so it may also be an in-memory file.
+    //
+    // The CompilerInvocation is a helper class which holds the data describing
+    // a compiler invocation (eg include paths, code generation options,
+    // warning flags, ..).
+    std::vector<std::string> cc1_args = buildCC1Args(opts, file);
+    std::vector<const char *> cc1_argv;
+    for (const std::string &arg : cc1_args)
+        cc1_argv.push_back(arg.c_str());
+    if (!clang::CompilerInvocation::CreateFromArgs(cc.getInvocation(), cc1_argv, *diag_eng))
+    {
+        std::puts("Failed to create CompilerInvocation!");
+        return false;
+    }
+
+    // Setup a TextDiagnosticPrinter printer with our diagnostic options to
+    // handle diagnostic messaged.
+    //
+    // The compiler will NOT take ownership of the DiagnosticConsumer object.
+    cc.createDiagnostics(diagConsumer, false /* own DiagnosticConsumer */);
+
+    // 所有翻译单元共用一个FileManager, 已经stat和读取过的头文件直接从缓存中取
+    cc.setFileManager(state ? state->fileManager.get() : &sharedFileCache().fileManager());
+
+    // Run action against our compiler instance.
+    if (memoryReport)
+    {
+        MemoryReportAction reportAction(action, *memoryReport);
+        return cc.ExecuteAction(reportAction);
+    }
+    return cc.ExecuteAction(action);
+}
+
+static void collectGlobals(Constant *c, SmallPtrSetImpl<Constant *> &visited, SetVector<GlobalValue *> &globals)
+{
+    if (!visited.insert(c).second)
+        return;
+    if (auto *gv = dyn_cast<GlobalValue>(c))
+    {
+        globals.insert(gv);
+        return;
+    }
+    for (Value *op : c->operands())
+    {
+        if (auto *opc = dyn_cast<Constant>(op))
+            collectGlobals(opc, visited, globals);
+    }
+}
+
+/// 函数体引用的全局变量和函数(不包括函数自己), 按第一次出现的顺序
+static SetVector<GlobalValue *> referencedGlobals(Function &fn)
+{
+    SmallPtrSet<Constant *, 32> visited;
+    SetVector<GlobalValue *> globals;
+    for (Instruction &inst : instructions(fn))
+    {
+        for (Value *op : inst.operands())
+        {
+            if (auto *c = dyn_cast<Constant>(op))
+                collectGlobals(c, visited, globals);
+        }
+    }
+    if (fn.hasPersonalityFn())
+        collectGlobals(fn.getPersonalityFn(), visited, globals);
+    globals.remove(&fn);
+    return globals;
+}
+
+/// 把一个函数定义复制到单独的模块中, 它引用的全局变量和函数在新模块里只有声明
+///
+/// promotedSuffix非空时, 引用的static符号在新模块中声明为加上这个后缀的hidden符号
+static std::unique_ptr<Module> extractFunction(Function &fn, StringRef promotedSuffix = "")
+{
+    Module &src = *fn.getParent();
+    auto chunk = std::make_unique<Module>(src.getModuleIdentifier(), src.getContext());
+    chunk->setSourceFileName(src.getSourceFileName());
+    chunk->setTargetTriple(src.getTargetTriple());
+    chunk->setDataLayout(src.getDataLayout());
+    SmallVector<Module::ModuleFlagEntry, 8> flags;
+    src.getModuleFlagsMetadata(flags);
+    for (const Module::ModuleFlagEntry &flag : flags)
+        chunk->addModuleFlag(flag.Behavior, flag.Key->getString(), flag.Val);
+
+    ValueToValueMapTy vmap;
+    for (GlobalValue *gv : referencedGlobals(fn))
+    {
+        GlobalValue *decl;
+        if (auto *callee = dyn_cast<Function>(gv))
+        {
+            Function *f = Function::Create(callee->getFunctionType(), GlobalValue::ExternalLinkage,
+                                           callee->getAddressSpace(), callee->getName(), chunk.get());
+            f->setCallingConv(callee->getCallingConv());
+            f->setAttributes(callee->getAttributes());
+            decl = f;
+        }
+        else if (gv->getValueType()->isFunctionTy())
+        {
+            decl = Function::Create(cast<FunctionType>(gv->getValueType()), GlobalValue::ExternalLinkage,
+                                    gv->getAddressSpace(), gv->getName(), chunk.get());
+        }
+        else
+        {
+            auto *var = new GlobalVariable(*chunk, gv->getValueType(), false, GlobalValue::ExternalLinkage,
+                                           nullptr, gv->getName(), nullptr, gv->getThreadLocalMode(),
+                                           gv->getAddressSpace());
+            if (auto *srcVar = dyn_cast<GlobalVariable>(gv))
+            {
+                var->setConstant(srcVar->isConstant());
+                var->setAlignment(srcVar->getAlign());
+            }
+            decl = var;
+        }
+        decl->setVisibility(gv->getVisibility());
+        decl->setDSOLocal(gv->isDSOLocal());
+        if (gv->hasLocalLinkage() && !promotedSuffix.empty())
+        {
+            decl->setName(Twine(gv->getName()) + promotedSuffix);
+            decl->setVisibility(GlobalValue::HiddenVisibility);
+        }
+        vmap[gv] = decl;
+    }
+
+    Function *copy = Function::Create(fn.getFunctionType(), fn.getLinkage(), fn.getAddressSpace(),
+                                      fn.getName(), chunk.get());
+    vmap[&fn] = copy;
+    Function::arg_iterator destArg = copy->arg_begin();
+    for (Argument &arg : fn.args())
+    {
+        destArg->setName(arg.getName());
+        vmap[&arg] = &*destArg++;
+    }
+    SmallVector<ReturnInst *, 8> returns;
+    CloneFunctionInto(copy, &fn, vmap, CloneFunctionChangeType::DifferentModule, returns);
+    return chunk;
+}
+
+/// 流式生成ir
+///
+/// 包装clang的CodeGenerator. 每个顶层函数定义生成完毕后, 立即把它复制到一个单独的模块写入输出目录,
+/// 然后删除主模块中的函数体, 所以ir占用的内存随最大的函数增长, 而不是随整个翻译单元增长.
+/// clang的AST仍然会保留整个翻译单元.
+///
+/// 输出目录中<文件名>.ll是剩下的部分(全局变量、声明、static函数等), <文件名>.<n>.ll是第n个函数,
+/// 用llvm-link或clang把它们链接到一起就是完整的翻译单元.
+class StreamingIRConsumer : public clang::ASTConsumer
+{
+public:
+    /// failed由action持有: 前端结束时consumer已经被释放, action仍然可以读取结果
+    StreamingIRConsumer(const Options &opts, StringRef file, std::unique_ptr<clang::CodeGenerator> gen, bool &failed)
+        : opts(opts), file(file.str()), gen(std::move(gen)), failed(failed)
+    {
+        promotedSuffix = ".llvm." + utohexstr(xxHash64(file));
+    }
+
+    void Initialize(clang::ASTContext &ctx) override
+    {
+        sourceManager = &ctx.getSourceManager();
+        gen->Initialize(ctx);
+    }
+
+    bool HandleTopLevelDecl(clang::DeclGroupRef group) override
+    {
+        gen->HandleTopLevelDecl(group);
+        Module *mod = gen->GetModule();
+        for (clang::Decl *decl : group)
+        {
+            auto *fd = dyn_cast<clang::FunctionDecl>(decl);
+            if (!mod || !fd || !fd->doesThisDeclarationHaveABody())
+                continue;
+            // static和inline函数由clang推迟到翻译单元结束时才生成, 留在主模块中
+            Function *fn = mod->getFunction(gen->GetMangledName(fd));
+            if (fn && !fn->isDeclaration() && fn->hasExternalLinkage())
+            {
+                if (!streamFunction(*fn))
+                    return false;
+            }
+            if (!checkMemory(fd->getNameAsString(), fd->getLocation()))
+                return false;
+        }
+        return true;
+    }
+
+    void HandleInlineFunctionDefinition(clang::FunctionDecl *fd) override
+    {
+        gen->HandleInlineFunctionDefinition(fd);
+    }
+
+    void HandleTagDeclDefinition(clang::TagDecl *td) override
+    {
+        gen->HandleTagDeclDefinition(td);
+    }
+
+    void HandleTagDeclRequiredDefinition(const clang::TagDecl *td) override
+    {
+        gen->HandleTagDeclRequiredDefinition(td);
+    }
+
+    void CompleteTentativeDefinition(clang::VarDecl *vd) override
+    {
+        gen->CompleteTentativeDefinition(vd);
+    }
+
+    void CompleteExternalDeclaration(clang::VarDecl *vd) override
+    {
+        gen->CompleteExternalDeclaration(vd);
+    }
+
+    void HandleTranslationUnit(clang::ASTContext &ctx) override
+    {
+        gen->HandleTranslationUnit(ctx);
+        // 有错误时CodeGenerator会丢弃模块
+        std::unique_ptr<Module> mod(gen->ReleaseModule());
+        if (!mod)
+        {
+            failed = true;
+            return;
+        }
+        for (const auto &name : promoted)
+        {
+            GlobalValue *gv = mod->getNamedValue(name.getKey());
+            if (!gv)
+                continue;
+            gv->setName(Twine(name.getKey()) + promotedSuffix);
+            gv->setLinkage(GlobalValue::ExternalLinkage);
+            gv->setVisibility(GlobalValue::HiddenVisibility);
+        }
+        if (!writeModule(*mod, outputPathFor(file, "ll")))
+            return;
+        checkMemory("", clang::SourceLocation());
+    }
+
+private:
+    bool streamFunction(Function &fn)
+    {
+        // 函数引用的static变量、字符串常量和static函数会出现在两个模块中, 像ThinLTO一样把它们提升为
+        // 带翻译单元后缀的hidden符号. clang按名字查找还没生成的static函数, 所以主模块中的改名推迟到最后
+        for (GlobalValue *gv : referencedGlobals(fn))
+        {
+            if (!gv->hasLocalLinkage())
+                continue;
+            if (!gv->hasName())
+                gv->setName("anon");
+            promoted.insert(gv->getName());
+        }
+
+        unsigned instructions = fn.getInstructionCount();
+        if (instructions > largestFunctionSize)
+        {
+            largestFunctionSize = instructions;
+            largestFunction = fn.getName().str();
+        }
+
+        std::unique_ptr<Module> chunk = extractFunction(fn, promotedSuffix);
+        if (!writeModule(*chunk, outputPathFor(file, std::to_string(++chunks) + ".ll")))
+            return false;
+        chunk.reset();
+        fn.deleteBody();
+        return true;
+    }
+
+    bool writeModule(Module &mod, StringRef name)
+    {
+        SmallString<256> path(opts.streamDir);
+        sys::path::append(path, name);
+        std::error_code ec;
+        raw_fd_ostream os(path, ec, sys::fs::OF_Text);
+        if (ec)
+        {
+            errs() << path << ": " << ec.message() << "\n";
+            failed = true;
+            return false;
+        }
+        mod.print(os, nullptr);
+        return true;
+    }
+
+    /// 超过--max-rss时报告正在处理的声明和目前最大的函数, 然后停止解析
+    bool checkMemory(const std::string &declName, clang::SourceLocation loc)
+    {
+        if (opts.maxRSSMB == 0)
+            return true;
+        // 用当前值而不是进程的峰值, 否则前一个大文件之后的所有文件都会超限
+        uint64_t rssMB = currentRSSBytes() >> 20;
+        if (rssMB <= opts.maxRSSMB)
+            return true;
+
+        errs() << file << ": RSS " << rssMB << " MB exceeds --max-rss=" << opts.maxRSSMB << " MB ";
+        if (declName.empty())
+            errs() << "while finishing the translation unit";
+        else
+            errs() << "after '" << declName << "' at " << loc.printToString(*sourceManager);
+        if (!largestFunction.empty())
+            errs() << "; largest function so far is '" << largestFunction << "' with "
+                   << largestFunctionSize << " instructions";
+        errs() << "\n";
+        failed = true;
+        return false;
+    }
+
+    const Options &opts;
+    std::string file;
+    std::unique_ptr<clang::CodeGenerator> gen;
+    clang::SourceManager *sourceManager = nullptr;
+    std::string promotedSuffix;
+    StringSet<> promoted;
+    unsigned chunks = 0;
+    std::string largestFunction;
+    unsigned largestFunctionSize = 0;
+    bool &failed;
+};
+
+class StreamingIRAction : public clang::ASTFrontendAction
+{
+public:
+    explicit StreamingIRAction(const Options &opts) : opts(opts) {}
+
+    bool succeeded() const { return !failed; }
+
+protected:
+    std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &ci, StringRef file) override
+    {
+        std::unique_ptr<clang::CodeGenerator> gen(clang::CreateLLVMCodeGen(
+            ci.getDiagnostics(), file, ci.getHeaderSearchOpts(), ci.getPreprocessorOpts(),
+            ci.getCodeGenOpts(), context));
+        return std::make_unique<StreamingIRConsumer>(opts, file, std::move(gen), failed);
+    }
+
+private:
+    const Options &opts;
+    LLVMContext context;
+    bool failed = false;
+};
+
+/// 流式生成ir, 写入--stream指定的目录
+static int emitIRStreaming(const Options &opts, const std::string &file)
+{
+    if (std::error_code ec = sys::fs::create_directories(opts.streamDir))
+    {
+        errs() << opts.streamDir << ": " << ec.message() << "\n";
+        return 1;
+    }
+    StreamingIRAction action(opts);
+    if (!runFrontendAction(opts, file, action) || !action.succeeded())
+    {
+        std::puts("Failed to run StreamingIRAction!");
+        return 1;
+    }
+    return 0;
+}
+
+/// 增量优化的统计
+struct IncrementalStats
+{
+    unsigned reused = 0;
+    unsigned rebuilt = 0;
+};
+
+/// 按函数缓存优化结果的增量优化
+///
+/// 只对每个函数运行函数级的简化流水线(不做内联等跨函数优化), 所以一个函数的优化结果只取决于它自己的ir、
+/// 它引用的全局符号的声明、常量的初始值和模块级设置. 把函数连同这些声明抽取到单独的模块中打印出来,
+/// 其哈希就是缓存键; 抽取出的模块中的编号与其它函数无关, 改动别的函数不会使缓存失效.
+///
+/// 函数按模块中的顺序处理. 命中缓存时把缓存的函数体拼接回来, 并按原来的顺序重新创建优化时新增的
+/// 全局符号(例如printf改成puts时新建的字符串常量和puts的声明), 所以输出与不用缓存时逐字节相同.
+class IncrementalOptimizer
+{
+public:
+    IncrementalOptimizer(const Options &opts, Module &mod)
+        : opts(opts), mod(mod), target(selectTarget(opts))
+    {
+        tm = createTargetMachine(target, opts.optLevel);
+        // 注册StandardInstrumentations后, --time-passes=json也能记录这里每个pass的耗时
+        si = std::make_unique<StandardInstrumentations>(false /* DebugLogging */);
+        si->registerCallbacks(pic, &fam);
+        pb = std::make_unique<PassBuilder>(tm.get(), PipelineTuningOptions(), None, &pic);
+        pb->registerModuleAnalyses(mam);
+        pb->registerCGSCCAnalyses(cgam);
+        pb->registerFunctionAnalyses(fam);
+        pb->registerLoopAnalyses(lam);
+        pb->crossRegisterProxies(lam, fam, cgam, mam);
+        // parseOptions保证增量模式只和-O1一起使用
+        fpm = pb->buildFunctionSimplificationPipeline(OptimizationLevel::O1, ThinOrFullLTOPhase::None);
+    }
+
+    IncrementalStats run()
+    {
+        // 调试信息的编译单元是整个模块共享的, 拼接回来的函数会带上另一份编译单元, 这种情况下不使用缓存
+        bool useCache = !mod.getNamedMetadata("llvm.dbg.cu");
+        if (!useCache)
+            errs() << mod.getSourceFileName() << ": debug info present, --incremental cache disabled\n";
+
+        std::vector<Function *> definitions;
+        for (Function &fn : mod)
+        {
+            if (!fn.isDeclaration())
+                definitions.push_back(&fn);
+        }
+        for (Function *fn : definitions)
+        {
+            std::string key = useCache ? functionKey(*fn) : "";
+            if (useCache && reuse(*fn, key))
+            {
+                ++stats.reused;
+                continue;
+            }
+            optimize(*fn, useCache ? key : "");
+            ++stats.rebuilt;
+        }
+        return stats;
+    }
+
+private:
+    std::string functionKey(Function &fn)
+    {
+        std::string text;
+        raw_string_ostream os(text);
+        os << "mcc-incremental-1 " << LLVM_VERSION_STRING << " O" << opts.optLevel << " "
+           << target.cpu << " " << join(target.features, ",") << "\n";
+        extractFunction(fn)->print(os, nullptr);
+        // InstCombine会从常量的初始值中折叠出结果
+        for (GlobalValue *gv : referencedGlobals(fn))
+        {
+            auto *var = dyn_cast<GlobalVariable>(gv);
+            if (var && var->isConstant() && var->hasDefinitiveInitializer())
+            {
+                os << var->getName() << " = ";
+                var->getInitializer()->print(os);
+                os << "\n";
+            }
+        }
+        MD5 hash;
+        hash.update(os.str());
+        MD5::MD5Result result;
+        hash.final(result);
+        return std::string(result.digest());
+    }
+
+    std::string entryPath(StringRef key)
+    {
+        SmallString<256> path(opts.incrementalDir);
+        sys::path::append(path, key + ".bc");
+        return std::string(path);
+    }
+
+    /// 运行函数级流水线, key非空时把结果写入缓存
+    void optimize(Function &fn, StringRef key)
+    {
+        SmallPtrSet<GlobalValue *, 32> existing;
+        for (GlobalValue &gv : mod.global_values())
+            existing.insert(&gv);
+
+        fpm.run(fn, fam);
+        // 每个函数都从空的分析缓存开始, 命中缓存与否不影响后面函数的优化结果
+        fam.clear();
+        mam.clear();
+
+        if (key.empty())
+            return;
+
+        // 优化时新建的全局变量和函数, 按模块中的顺序
+        std::vector<GlobalValue *> created;
+        for (GlobalValue &gv : mod.global_values())
+        {
+            if (!existing.count(&gv))
+                created.push_back(&gv);
+        }
+
+        std::unique_ptr<Module> entry = extractFunction(fn);
+        NamedMDNode *createdMD = entry->getOrInsertNamedMetadata("mcc.incremental.created");
+        for (GlobalValue *gv : created)
+        {
+            // 新建后又不再被引用的符号无法从抽取的模块中恢复, 这个函数不缓存
+            GlobalValue *copy = entry->getNamedValue(gv->getName());
+            if (!copy)
+                return;
+            if (auto *var = dyn_cast<GlobalVariable>(gv))
+            {
+                // 新建的字符串常量需要连同初始值一起缓存, 初始值引用其它全局符号时放弃缓存
+                SmallPtrSet<Constant *, 8> visited;
+                SetVector<GlobalValue *> uses;
+                if (var->hasInitializer())
+                    collectGlobals(var->getInitializer(), visited, uses);
+                auto *copyVar = dyn_cast<GlobalVariable>(copy);
+                if (!var->hasInitializer() || !uses.empty() || !copyVar)
+                    return;
+                copyVar->setInitializer(var->getInitializer());
+                copyVar->setLinkage(var->getLinkage());
+                copyVar->setUnnamedAddr(var->getUnnamedAddr());
+            }
+            createdMD->addOperand(MDNode::get(entry->getContext(), MDString::get(entry->getContext(), gv->getName())));
+        }
+
+        // 先写临时文件再改名, 并发的mcc不会读到写了一半的条目
+        std::string path = entryPath(key);
+        SmallString<256> tmp;
+        int fd;
+        if (sys::fs::createUniqueFile(path + ".tmp%%%%%%", fd, tmp))
+            return;
+        {
+            raw_fd_ostream os(fd, true /* shouldClose */);
+            WriteBitcodeToFile(*entry, os);
+        }
+        if (sys::fs::rename(tmp, path))
+            sys::fs::remove(tmp);
+    }
+
+    /// 用缓存的函数体替换fn的函数体, 缓存不存在或与当前模块对不上时返回false
+    bool reuse(Function &fn, StringRef key)
+    {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(entryPath(key));
+        if (!buffer)
+            return false;
+        Expected<std::unique_ptr<Module>> entry = parseBitcodeFile((*buffer)->getMemBufferRef(), mod.getContext());
+        if (!entry)
+        {
+            consumeError(entry.takeError());
+            return false;
+        }
+        Function *cached = (*entry)->getFunction(fn.getName());
+        if (!cached || cached->isDeclaration() || cached->getFunctionType() != fn.getFunctionType())
+            return false;
+
+        // 优化时新建的符号, 按创建时在模块中的顺序
+        std::vector<GlobalValue *> createdList;
+        StringSet<> created;
+        if (NamedMDNode *createdMD = (*entry)->getNamedMetadata("mcc.incremental.created"))
+        {
+            for (MDNode *node : createdMD->operands())
+            {
+                StringRef name = cast<MDString>(node->getOperand(0))->getString();
+                GlobalValue *gv = (*entry)->getNamedValue(name);
+                if (!gv)
+                    return false;
+                createdList.push_back(gv);
+                created.insert(name);
+            }
+        }
+
+        // 先确认缓存中引用的已有符号在当前模块中都存在且声明一致, 再修改模块
+        ValueToValueMapTy vmap;
+        SetVector<GlobalValue *> uses = referencedGlobals(*cached);
+        for (GlobalValue *gv : uses)
+        {
+            if (created.count(gv->getName()))
+                continue;
+            GlobalValue *local = mod.getNamedValue(gv->getName());
+            if (!local || local->getValueType() != gv->getValueType())
+                return false;
+            auto *localFn = dyn_cast<Function>(local);
+            auto *cachedFn = dyn_cast<Function>(gv);
+            if (localFn && cachedFn && localFn->getAttributes() != cachedFn->getAttributes())
+                return false;
+            vmap[gv] = local;
+        }
+
+        // 按优化时的顺序重新创建新增的符号. 函数声明由getOrInsertFunction创建, 已经存在时复用;
+        // 字符串常量每次都新建, 重名时由模块按同样的规则加后缀
+        for (GlobalValue *gv : createdList)
+        {
+            if (auto *cachedFn = dyn_cast<Function>(gv))
+            {
+                Function *decl = mod.getFunction(cachedFn->getName());
+                if (!decl)
+                {
+                    decl = Function::Create(cachedFn->getFunctionType(), GlobalValue::ExternalLinkage,
+                                            cachedFn->getAddressSpace(), cachedFn->getName(), &mod);
+                    decl->setCallingConv(cachedFn->getCallingConv());
+                    decl->setAttributes(cachedFn->getAttributes());
+                }
+                vmap[gv] = decl;
+            }
+            else if (auto *cachedVar = dyn_cast<GlobalVariable>(gv))
+            {
+                auto *var = new GlobalVariable(mod, cachedVar->getValueType(), cachedVar->isConstant(),
+                                               cachedVar->getLinkage(), cachedVar->getInitializer(),
+                                               baseName(cachedVar->getName()), nullptr,
+                                               cachedVar->getThreadLocalMode(), cachedVar->getAddressSpace());
+                var->copyAttributesFrom(cachedVar);
+                vmap[gv] = var;
+            }
+        }
+
+        vmap[cached] = &fn;
+        Function::arg_iterator destArg = fn.arg_begin();
+        for (Argument &arg : cached->args())
+            vmap[&arg] = &*destArg++;
+
+        GlobalValue::LinkageTypes linkage = fn.getLinkage();
+        fn.deleteBody();
+        fn.setLinkage(linkage);
+        SmallVector<ReturnInst *, 8> returns;
+        CloneFunctionInto(&fn, cached, vmap, CloneFunctionChangeType::DifferentModule, returns);
+        return true;
+    }
+
+    /// 去掉模块为避免重名加上的.N后缀, 得到优化pass请求的名字
+    static StringRef baseName(StringRef name)
+    {
+        size_t dot = name.rfind('.');
+        if (dot != StringRef::npos && dot + 1 < name.size() &&
+            llvm::all_of(name.substr(dot + 1), isDigit))
+            return name.substr(0, dot);
+        return name;
+    }
+
+    const Options &opts;
+    Module &mod;
+    TargetSelection target;
+    std::unique_ptr<TargetMachine> tm;
+    PassInstrumentationCallbacks pic;
+    std::unique_ptr<StandardInstrumentations> si;
+    std::unique_ptr<PassBuilder> pb;
+    LoopAnalysisManager lam;
+    FunctionAnalysisManager fam;
+    CGSCCAnalysisManager cgam;
+    ModuleAnalysisManager mam;
+    FunctionPassManager fpm;
+    IncrementalStats stats;
+};
+
+/// 生成llvm ir, 只有一个输入文件时打印到标准输出
+static int emitIR(const Options &opts, const std::string &file)
+{
+    if (!opts.streamDir.empty())
+        return emitIRStreaming(opts, file);
+
+    // Create action to generate LLVM IR.
+    //
+    // If created with default arguments, the EmitLLVMOnlyAction will allocate
+    // an owned LLVMContext and free it once the action goes out of scope.
+    //
+    // To keep the context after the action goes out of scope, either pass a
+    // LLVMContext (borrowed) when creating the EmitLLVMOnlyAction or call
+    // takeLLVMContext() to move ownership out of the action.
+    MemoryReport report;
+    uint64_t mallocBefore = mallocBytesInUse();
+    uint64_t cachedBefore = sharedFileCache().stats().bytesRead;
+    clang::EmitLLVMOnlyAction action;
+    if (!runFrontendAction(opts, file, action, nullptr, nullptr, opts.memReport ? &report : nullptr))
+    {
+        std::puts("Failed to run EmitLLVMOnlyAction!");
+        return 1;
+    }
+
+    if (opts.remarksSummary)
+        printRemarksSummary(remarksPathFor(opts, file));
+
+    auto mod = action.takeModule();
+    if (!mod)
+        return 0;
+
+    if (opts.memReport)
+    {
+        // 前端已经释放, 此时malloc的增长就是LLVMContext和模块, 减去新读入共享文件缓存的文件内容
+        uint64_t cached = sharedFileCache().stats().bytesRead - cachedBefore;
+        // 前端释放的内存可能比LLVMContext多, 这时malloc的用量反而下降, 先比较再相减
+        uint64_t mallocAfter = mallocBytesInUse();
+        uint64_t grown = mallocAfter > mallocBefore ? mallocAfter - mallocBefore : 0;
+        report.addBytes("LLVMContext and module", grown > cached ? grown - cached : 0);
+        report.addCount("functions", mod->size());
+        report.addCount("global variables", mod->global_size());
+        report.addCount("instructions", mod->getInstructionCount());
+    }
+
+    // data layout以TargetMachine为准, 不使用写死的字符串
+    if (std::unique_ptr<TargetMachine> tm = createTargetMachine(selectTarget(opts), opts.optLevel))
+        mod->setDataLayout(tm->createDataLayout());
+
+    if (!opts.incrementalDir.empty())
+    {
+        if (std::error_code ec = sys::fs::create_directories(opts.incrementalDir))
+        {
+            errs() << opts.incrementalDir << ": " << ec.message() << "\n";
+            return 1;
+        }
+        IncrementalStats stats = IncrementalOptimizer(opts, *mod).run();
+        errs() << file << ": " << stats.reused << " functions reused, " << stats.rebuilt << " rebuilt\n";
+        if (opts.memReport)
+            report.addBytes("RSS after optimization", currentRSSBytes());
+    }
+
+    // Take generated LLVM IR module and print to stdout.
+    // 一次编译多个文件时, 每个文件的ir写入各自的.ll文件
+    if (opts.inputs.size() == 1)
+        mod->print(llvm::outs(), nullptr);
+    else
+    {
+        std::error_code ec;
+        raw_fd_ostream os(outputPathFor(file, "ll"), ec, sys::fs::OF_Text);
+        if (ec)
+        {
+            errs() << outputPathFor(file, "ll") << ": " << ec.message() << "\n";
+            return 1;
+        }
+        mod->print(os, nullptr);
+    }
+
+    if (opts.memReport)
+    {
+        report.addBytes("RSS after writing ir", currentRSSBytes());
+        report.print(file);
+    }
+    return 0;
+}
+
+/// 生成bitcode文件, 使用--thinlto时附带ThinLTO summary索引
+static int emitBitcode(const Options &opts, const std::string &file)
+{
+    MemoryReport report;
+    clang::EmitBCAction action;
+    if (!runFrontendAction(opts, file, action, nullptr, nullptr, opts.memReport ? &report : nullptr))
+    {
+        std::puts("Failed to run EmitBCAction!");
+        return 1;
+    }
+    if (opts.remarksSummary)
+        printRemarksSummary(remarksPathFor(opts, file));
+    if (opts.memReport)
+        report.print(file);
+    return 0;
+}
+
+/// LLVM的Statistic计数和各个pass的耗时, 每个翻译单元输出一个json文档, 批量编译时再输出所有翻译单元的汇总
+///
+/// 计数来自LLVM的Statistic(只有打开了LLVM_ENABLE_STATS的LLVM才会真正计数), 耗时来自time trace profiler,
+/// 其中既有前端的解析、语义分析, 也有优化和代码生成流水线中的每个pass.
+class PassMetrics
+{
+public:
+    explicit PassMetrics(const Options &opts) : opts(opts)
+    {
+        if (opts.statsJSON)
+        {
+            EnableStatistics(false /* DoPrintOnExit */);
+            if (!AreStatisticsEnabled())
+                errs() << "warning: LLVM statistics are disabled, --stats=json will be empty\n";
+        }
+    }
+
+    void begin()
+    {
+        if (opts.statsJSON)
+            ResetStatistics();
+        if (opts.timePassesJSON)
+            timeTraceProfilerInitialize(0 /* TimeTraceGranularity */, "mcc");
+    }
+
+    /// 写出<文件名>.stats.json, 并累加到汇总中
+    void end(const std::string &file)
+    {
+        json::Object doc{{"file", file}};
+        if (opts.statsJSON)
+        {
+            json::Object statistics = collectStatistics();
+            // 没有打开LLVM_ENABLE_STATS的LLVM不计数, 提示一次而不是默默写出空对象
+            if (statistics.empty() && !warnedNoStatistics)
+            {
+                errs() << "warning: no LLVM statistics were recorded, LLVM was probably built without LLVM_ENABLE_STATS\n";
+                warnedNoStatistics = true;
+            }
+            for (const auto &entry : statistics)
+            {
+                int64_t &sum = totalStatistics[entry.first.str()];
+                sum += entry.second.getAsInteger().getValueOr(0);
+            }
+            doc["statistics"] = std::move(statistics);
+        }
+        if (opts.timePassesJSON)
+        {
+            json::Object timers = collectTimers();
+            for (const auto &entry : timers)
+            {
+                const json::Object *timer = entry.second.getAsObject();
+                PassTime &sum = totalTimers[entry.first.str()];
+                sum.count += timer->getInteger("count").getValueOr(0);
+                sum.wallUs += timer->getInteger("wall_us").getValueOr(0);
+            }
+            doc["timers"] = std::move(timers);
+        }
+        ++files;
+        if (opts.statsJSON || opts.timePassesJSON)
+            writeJSON(outputPathFor(file, "stats.json"), std::move(doc));
+    }
+
+    /// 多个翻译单元时写出汇总mcc.stats.json
+    void finish()
+    {
+        if ((!opts.statsJSON && !opts.timePassesJSON) || files < 2)
+            return;
+        json::Object doc{{"files", files}};
+        if (opts.statsJSON)
+        {
+            json::Object statistics;
+            for (const auto &entry : totalStatistics)
+                statistics[entry.first] = entry.second;
+            doc["statistics"] = std::move(statistics);
+        }
+        if (opts.timePassesJSON)
+        {
+            json::Object timers;
+            for (const auto &entry : totalTimers)
+                timers[entry.first] = json::Object{{"count", entry.second.count}, {"wall_us", entry.second.wallUs}};
+            doc["timers"] = std::move(timers);
+        }
+        writeJSON("mcc.stats.json", std::move(doc));
+    }
+
+private:
+    struct PassTime
+    {
+        int64_t count = 0;
+        int64_t wallUs = 0;
+    };
+
+    /// PrintStatisticsJSON输出"DEBUG_TYPE.名字": 值, 末尾还附带了计时器的值, 后者由time trace代替
+    json::Object collectStatistics()
+    {
+        std::string text;
+        raw_string_ostream os(text);
+        PrintStatisticsJSON(os);
+        json::Object statistics;
+        Expected<json::Value> parsed = json::parse(os.str());
+        if (!parsed)
+        {
+            errs() << toString(parsed.takeError()) << "\n";
+            return statistics;
+        }
+        if (const json::Object *obj = parsed->getAsObject())
+        {
+            for (const auto &entry : *obj)
+            {
+                if (!StringRef(entry.first).startswith("time."))
+                    statistics[entry.first] = entry.second;
+            }
+        }
+        return statistics;
+    }
+
+    /// time trace中"Total 名字"事件是同名事件的总次数和总耗时, 每个pass、前端和后端阶段各有一个
+    json::Object collectTimers()
+    {
+        SmallString<0> trace;
+        raw_svector_ostream os(trace);
+        timeTraceProfilerWrite(os);
+        timeTraceProfilerCleanup();
+
+        json::Object timers;
+        Expected<json::Value> parsed = json::parse(trace);
+        if (!parsed)
+        {
+            errs() << toString(parsed.takeError()) << "\n";
+            return timers;
+        }
+        const json::Object *root = parsed->getAsObject();
+        const json::Array *events = root ? root->getArray("traceEvents") : nullptr;
+        if (!events)
+            return timers;
+        for (const json::Value &value : *events)
+        {
+            const json::Object *event = value.getAsObject();
+            if (!event)
+                continue;
+            auto name = event->getString("name");
+            if (!name || !name->consume_front("Total "))
+                continue;
+            const json::Object *args = event->getObject("args");
+            int64_t count = args ? args->getInteger("count").getValueOr(0) : 0;
+            // name指向parsed中的字符串, ObjectKey(StringRef)不复制, 键必须自己持有
+            timers[name->str()] = json::Object{
+                {"count", count},
+                {"wall_us", event->getInteger("dur").getValueOr(0)},
+            };
+        }
+        return timers;
+    }
+
+    static void writeJSON(StringRef path, json::Object doc)
+    {
+        std::error_code ec;
+        raw_fd_ostream os(path, ec, sys::fs::OF_Text);
+        if (ec)
+        {
+            errs() << path << ": " << ec.message() << "\n";
+            return;
+        }
+        os << formatv("{0:2}", json::Value(std::move(doc))) << "\n";
+    }
+
+    const Options &opts;
+    int64_t files = 0;
+    bool warnedNoStatistics = false;
+    std::map<std::string, int64_t> totalStatistics;
+    std::map<std::string, PassTime> totalTimers;
+};
+
+/// 统计缓存目录中的条目数, localCache写入的文件都以llvmcache-开头
+static unsigned countCacheEntries(StringRef dir)
+{
+    unsigned count = 0;
+    std::error_code ec;
+    for (sys::fs::directory_iterator it(dir, ec), end; it != end && !ec; it.increment(ec))
+    {
+        if (sys::path::filename(it->path()).startswith("llvmcache-"))
+            ++count;
+    }
+    return count;
+}
+
+/// ThinLTO链接: 合并summary索引, 跨模块导入函数, 并行优化和生成目标文件
+///
+/// 每个输入a.bc生成一个a.o, 由系统链接器完成最终链接
+static int thinLTOLink(const Options &opts)
+{
+    TargetSelection target = selectTarget(opts);
+    lto::Config conf;
+    conf.DefaultTriple = target.triple;
+    conf.CPU = target.cpu;
+    conf.MAttrs = target.features;
+    conf.RelocModel = Reloc::PIC_;
+    conf.OptLevel = opts.optLevel > 0 ? opts.optLevel : 2;
+    conf.CGOptLevel = codeGenOptLevel(conf.OptLevel);
+
+    lto::LTO ltoLink(std::move(conf),
+                     lto::createInProcessThinBackend(heavyweight_hardware_concurrency(opts.jobs)));
+
+    // InputFile只引用buffer, buffer需要活到链接结束
+    std::vector<std::unique_ptr<MemoryBuffer>> buffers;
+    // 任务0是合并后的普通LTO模块, 之后每个ThinLTO模块按加入的顺序各占一个任务
+    std::vector<std::string> taskObjects = {outputPathFor("ld-temp", "o")};
+    // 目标文件只按文件名放在当前目录, a/x.bc和b/x.bc会写到同一个x.o, 记下每个目标文件来自哪个输入
+    StringMap<std::string> objectInputs;
+    StringSet<> defined;
+    for (const std::string &path : opts.inputs)
+    {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(path);
+        if (!buffer)
+        {
+            errs() << path << ": " << buffer.getError().message() << "\n";
+            return 1;
+        }
+        Expected<std::unique_ptr<lto::InputFile>> input =
+            lto::InputFile::create((*buffer)->getMemBufferRef());
+        if (!input)
+        {
+            errs() << path << ": " << toString(input.takeError()) << "\n";
+            return 1;
+        }
+        Expected<BitcodeLTOInfo> ltoInfo = (*input)->getSingleBitcodeModule().getLTOInfo();
+        if (!ltoInfo)
+        {
+            errs() << path << ": " << toString(ltoInfo.takeError()) << "\n";
+            return 1;
+        }
+        if (ltoInfo->IsThinLTO)
+        {
+            std::string object = outputPathFor(path, "o");
+            auto inserted = objectInputs.try_emplace(object, path);
+            if (!inserted.second)
+            {
+                errs() << path << ": object file " << object << " would overwrite the one from "
+                       << inserted.first->getValue() << ", rename one of the inputs\n";
+                return 1;
+            }
+            taskObjects.push_back(std::move(object));
+        }
+
+        // 第一个定义胜出. 输出的目标文件还要交给系统链接器,
+        // 所以保守地认为每个符号都可能被普通目标文件引用
+        std::vector<lto::SymbolResolution> resolutions;
+        for (const lto::InputFile::Symbol &sym : (*input)->symbols())
+        {
+            lto::SymbolResolution res;
+            res.Prevailing = !sym.isUndefined() && defined.insert(sym.getName()).second;
+            res.VisibleToRegularObj = true;
+            resolutions.push_back(res);
+        }
+        if (Error err = ltoLink.add(std::move(*input), resolutions))
+        {
+            errs() << path << ": " << toString(std::move(err)) << "\n";
+            return 1;
+        }
+        buffers.push_back(std::move(*buffer));
+    }
+
+    auto objectPath = [&](unsigned task)
+    {
+        return task < taskObjects.size() ? taskObjects[task] : outputPathFor("ld-temp" + std::to_string(task), "o");
+    };
+
+    auto addStream = [&](unsigned task) -> Expected<std::unique_ptr<CachedFileStream>>
+    {
+        std::error_code ec;
+        std::string path = objectPath(task);
+        auto os = std::make_unique<raw_fd_ostream>(path, ec, sys::fs::OF_None);
+        if (ec)
+            return createFileError(path, ec);
+        return std::make_unique<CachedFileStream>(std::move(os), path);
+    };
+
+    // 命中缓存的模块不会再优化和生成代码, 直接把缓存中的目标文件写出
+    auto addBuffer = [&](unsigned task, std::unique_ptr<MemoryBuffer> mb)
+    {
+        std::error_code ec;
+        raw_fd_ostream os(objectPath(task), ec, sys::fs::OF_None);
+        if (ec)
+        {
+            errs() << objectPath(task) << ": " << ec.message() << "\n";
+            return;
+        }
+        os << mb->getBuffer();
+    };
+
+    FileCache cache;
+    unsigned cachedBefore = 0;
+    if (!opts.thinltoCache.empty())
+    {
+        Expected<FileCache> localCacheOrErr =
+            localCache("ThinLTO", "Thin", opts.thinltoCache, addBuffer);
+        if (!localCacheOrErr)
+        {
+            errs() << toString(localCacheOrErr.takeError()) << "\n";
+            return 1;
+        }
+        cache = std::move(*localCacheOrErr);
+        cachedBefore = countCacheEntries(opts.thinltoCache);
+    }
+
+    if (Error err = ltoLink.run(addStream, cache))
+    {
+        errs() << toString(std::move(err)) << "\n";
+        return 1;
+    }
+
+    if (!opts.thinltoCache.empty())
+    {
+        // 每个未命中的模块会在缓存目录新增一个条目. 只有ThinLTO模块经过缓存, 任务0的普通LTO模块不算
+        unsigned thinModules = taskObjects.size() - 1;
+        unsigned rebuilt = std::min(countCacheEntries(opts.thinltoCache) - cachedBefore, thinModules);
+        errs() << "ThinLTO cache: " << thinModules - rebuilt << " reused, " << rebuilt << " rebuilt\n";
+    }
+    return 0;
+}
+
+/// --check的诊断输出, 多个线程共用, 每条诊断产生时立即写出
+///
+/// json格式每行一条记录(JSON Lines); sarif格式是一个SARIF 2.1.0文档, 开头和结尾在构造和finish()时写出,
+/// 中间的results数组逐条写出.
+class DiagnosticWriter
+{
+public:
+    explicit DiagnosticWriter(const Options &opts) : sarif(opts.diagFormat == "sarif")
+    {
+        if (!sarif)
+            return;
+        stream = std::make_unique<json::OStream>(outs(), 2);
+        stream->objectBegin();
+        stream->attribute("version", "2.1.0");
+        stream->attribute("$schema", "https://json.schemastore.org/sarif-2.1.0.json");
+        stream->attributeBegin("runs");
+        stream->arrayBegin();
+        stream->objectBegin();
+        stream->attribute("tool", json::Object{{"driver", json::Object{{"name", "mcc"}}}});
+        stream->attributeBegin("results");
+        stream->arrayBegin();
+    }
 
-    clang_disposeString(kindName);
-    return result;
+    struct Record
+    {
+        std::string file;
+        StringRef severity;
+        std::string path;
+        unsigned line = 0;
+        unsigned column = 0;
+        std::string message;
+        std::string option;
+    };
+
+    void write(const Record &record)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!sarif)
+        {
+            json::OStream line(outs());
+            line.value(json::Object{
+                {"file", record.file},
+                {"severity", record.severity},
+                {"path", record.path},
+                {"line", record.line},
+                {"column", record.column},
+                {"message", record.message},
+                {"option", record.option},
+            });
+            outs() << "\n";
+            outs().flush();
+            return;
+        }
+        json::Object result{
+            {"ruleId", record.option.empty() ? "clang" : record.option},
+            {"level", record.severity == "fatal" ? "error" : record.severity == "remark" ? "note" : record.severity},
+            {"message", json::Object{{"text", record.message}}},
+        };
+        if (!record.path.empty())
+        {
+            result["locations"] = json::Array{json::Object{{"physicalLocation", json::Object{
+                {"artifactLocation", json::Object{{"uri", record.path}}},
+                {"region", json::Object{{"startLine", record.line}, {"startColumn", record.column}}},
+            }}}};
+        }
+        stream->value(std::move(result));
+        outs().flush();
+    }
+
+    void finish()
+    {
+        if (!sarif)
+            return;
+        stream->arrayEnd();
+        stream->attributeEnd();
+        stream->objectEnd();
+        stream->arrayEnd();
+        stream->attributeEnd();
+        stream->objectEnd();
+        stream.reset();
+        outs() << "\n";
+    }
+
+private:
+    bool sarif;
+    std::mutex mutex;
+    std::unique_ptr<json::OStream> stream;
+};
+
+/// 把诊断直接转成DiagnosticWriter的记录, 不经过文本格式化和libclang的CXDiagnostic
+class StreamingDiagnosticConsumer : public clang::DiagnosticConsumer
+{
+public:
+    StreamingDiagnosticConsumer(DiagnosticWriter &writer, const std::string &file) : writer(writer), file(file) {}
+
+    void HandleDiagnostic(clang::DiagnosticsEngine::Level level, const clang::Diagnostic &info) override
+    {
+        // 基类负责统计错误和警告数
+        DiagnosticConsumer::HandleDiagnostic(level, info);
+
+        DiagnosticWriter::Record record;
+        record.file = file;
+        switch (level)
+        {
+        case clang::DiagnosticsEngine::Ignored:
+            return;
+        case clang::DiagnosticsEngine::Note:
+            record.severity = "note";
+            break;
+        case clang::DiagnosticsEngine::Remark:
+            record.severity = "remark";
+            break;
+        case clang::DiagnosticsEngine::Warning:
+            record.severity = "warning";
+            break;
+        case clang::DiagnosticsEngine::Error:
+            record.severity = "error";
+            break;
+        case clang::DiagnosticsEngine::Fatal:
+            record.severity = "fatal";
+            break;
+        }
+        if (info.hasSourceManager() && info.getLocation().isValid())
+        {
+            clang::PresumedLoc loc = info.getSourceManager().getPresumedLoc(info.getLocation());
+            if (loc.isValid())
+            {
+                record.path = loc.getFilename();
+                record.line = loc.getLine();
+                record.column = loc.getColumn();
+            }
+        }
+        SmallString<256> message;
+        info.FormatDiagnostic(message);
+        record.message = std::string(message);
+        StringRef option = clang::DiagnosticIDs::getWarningOptionForDiag(info.getID());
+        if (!option.empty())
+            record.option = ("-W" + option).str();
+        writer.write(record);
+    }
+
+private:
+    DiagnosticWriter &writer;
+    std::string file;
+};
+
+/// 只运行前端(-fsyntax-only)检查每个文件, 诊断以json或SARIF格式逐条写到标准输出
+///
+/// 文件在-j N个线程上并行检查. 每个线程有自己的FileManager和模块缓存, 底层共用线程安全的文件缓存.
+/// 有文件出现错误时返回1.
+static int checkFiles(const Options &opts)
+{
+    DiagnosticWriter writer(opts);
+    unsigned workers = std::min<size_t>(heavyweight_hardware_concurrency(opts.jobs).compute_thread_count(),
+                                        opts.inputs.size());
+    std::vector<std::unique_ptr<FrontendState>> states(std::max(workers, 1u));
+    std::atomic<unsigned> errors{0};
+    std::atomic<unsigned> warnings{0};
+    std::atomic<unsigned> failedFiles{0};
+
+    // 给出--mem-budget时按文件大小和已经观察到的前端内存决定同时检查几个文件
+    std::unique_ptr<MemoryBudget> budget;
+    if (opts.memBudgetMB > 0)
+    {
+        std::vector<uint64_t> sizes;
+        for (const std::string &file : opts.inputs)
+        {
+            ErrorOr<vfs::Status> status = sharedFileCache().vfs()->status(file);
+            sizes.push_back(status ? status->getSize() : 0);
+        }
+        budget = std::make_unique<MemoryBudget>(opts.memBudgetMB << 20, std::move(sizes));
+    }
+
+    runParallel(workers, opts.inputs.size(), [&](unsigned worker, size_t i) {
+        if (!states[worker])
+            states[worker] = std::make_unique<FrontendState>();
+        StreamingDiagnosticConsumer consumer(writer, opts.inputs[i]);
+        clang::SyntaxOnlyAction action;
+        MemoryReport report;
+        bool measure = opts.memReport || budget;
+        runFrontendAction(opts, opts.inputs[i], action, &consumer, states[worker].get(), measure ? &report : nullptr);
+        if (budget)
+            budget->record(i, report.frontendBytes);
+        if (opts.memReport)
+            report.print(opts.inputs[i]);
+        errors += consumer.getNumErrors();
+        warnings += consumer.getNumWarnings();
+        if (consumer.getNumErrors() > 0)
+            ++failedFiles;
+    }, budget.get());
+    writer.finish();
+
+    errs() << "checked " << opts.inputs.size() << " files: " << errors << " errors, " << warnings << " warnings\n";
+    return failedFiles > 0 ? 1 : 0;
 }
 
-std::string getCursorSpelling(CXCursor cursor)
+/// 一个要扫描依赖的文件及其编译命令
+struct ScanJob
 {
-    CXString cursorSpelling = clang_getCursorSpelling(cursor);
-    std::string result = clang_getCString(cursorSpelling);
+    std::string file;
+    std::string directory;
+    std::vector<std::string> commandLine;
+};
 
-    clang_disposeString(cursorSpelling);
-    return result;
+/// 从编译数据库或命令行上的文件得到扫描任务
+static bool collectScanJobs(const Options &opts, std::vector<ScanJob> &jobs)
+{
+    if (!opts.compileDB.empty())
+    {
+        std::string error;
+        std::unique_ptr<clang::tooling::JSONCompilationDatabase> db = clang::tooling::JSONCompilationDatabase::loadFromFile(
+            opts.compileDB, error, clang::tooling::JSONCommandLineSyntax::AutoDetect);
+        if (!db)
+        {
+            errs() << opts.compileDB << ": " << error << "\n";
+            return false;
+        }
+        for (clang::tooling::CompileCommand &command : db->getAllCompileCommands())
+            jobs.push_back({command.Filename, command.Directory, std::move(command.CommandLine)});
+    }
+
+    SmallString<256> cwd;
+    sys::fs::current_path(cwd);
+    for (const std::string &file : opts.inputs)
+        // 命令中的clang不是真的路径, driver无法据此找到资源目录, 直接指定
+        jobs.push_back({file, std::string(cwd), {"clang", "-resource-dir", MCC_RESOURCE_DIR, "-c", file}});
+    return true;
 }
 
-CXChildVisitResult prettyPrintAst(CXCursor cursor, CXCursor /* parent */, CXClientData clientData)
+/// 解析Makefile格式的依赖: "目标: 依赖1 依赖2 \
+///   依赖3", 文件名中的空格写作"\ ", $写作$$
+static bool parseMakeDeps(StringRef text, std::string &target, std::vector<std::string> &deps)
 {
-    CXSourceLocation location = clang_getCursorLocation(cursor);
-    if (clang_Location_isFromMainFile(location) == 0)
-        return CXChildVisit_Continue;
+    std::vector<std::string> words;
+    std::string word;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        char c = text[i];
+        if (c == '\\' && i + 1 < text.size() && (text[i + 1] == '\n' || text[i + 1] == '\r'))
+            continue; // 续行符, 换行本身在下一轮作为空白处理
+        if (c == '\\' && i + 1 < text.size() && (text[i + 1] == ' ' || text[i + 1] == '#'))
+            word += text[++i];
+        else if (c == '$' && i + 1 < text.size() && text[i + 1] == '$')
+            word += text[++i];
+        else if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+        {
+            if (!word.empty())
+                words.push_back(std::move(word));
+            word.clear();
+        }
+        else
+            word += c;
+    }
+    if (!word.empty())
+        words.push_back(std::move(word));
 
-    CXCursorKind cursorKind = clang_getCursorKind(cursor);
+    if (words.empty() || !StringRef(words[0]).endswith(":"))
+        return false;
+    target = words[0].substr(0, words[0].size() - 1);
+    deps.assign(words.begin() + 1, words.end());
+    return true;
+}
 
-    unsigned int curLevel = *(reinterpret_cast<unsigned int *>(clientData));
-    unsigned int nextLevel = curLevel + 1;
+/// 扫描每个文件包含的头文件, 输出Makefile格式或json格式的依赖
+///
+/// 使用clang的依赖扫描: 源文件和头文件先被精简成只剩预处理指令(#include、#if、#define等), 然后只运行预处理器,
+/// 不做语义分析和代码生成. 精简结果和stat结果由DependencyScanningService在所有文件和线程间共享.
+/// clang 14的扫描器自己创建真实文件系统(工作目录各自独立), 不经过共享文件缓存, 也看不到内存中的文件.
+static int scanDeps(const Options &opts)
+{
+    using namespace clang::tooling::dependencies;
 
-    std::cout << std::string(curLevel, '-') << " " << getCursorKindName(cursorKind) << " (" << getCursorSpelling(cursor) << ")\n";
+    std::vector<ScanJob> jobs;
+    if (!collectScanJobs(opts, jobs))
+        return 1;
 
-    clang_visitChildren(cursor,
-                        prettyPrintAst,
-                        &nextLevel);
+    auto start = std::chrono::steady_clock::now();
+    DependencyScanningService service(ScanningMode::MinimizedSourcePreprocessing, ScanningOutputFormat::Make);
+    unsigned workers = std::min<size_t>(heavyweight_hardware_concurrency(opts.jobs).compute_thread_count(), jobs.size());
+    // DependencyScanningTool不是线程安全的, 每个线程一个
+    std::vector<std::unique_ptr<DependencyScanningTool>> tools;
+    for (unsigned i = 0; i < workers; ++i)
+        tools.push_back(std::make_unique<DependencyScanningTool>(service));
 
-    return CXChildVisit_Continue;
-}
+    // Expected在多个线程间传递不方便, 结果和错误信息分开存放
+    std::vector<std::string> results(jobs.size());
+    std::vector<std::string> errors(jobs.size());
+    runParallel(workers, jobs.size(), [&](unsigned worker, size_t i) {
+        Expected<std::string> deps = tools[worker]->getDependencyFile(jobs[i].commandLine, jobs[i].directory);
+        if (deps)
+            results[i] = std::move(*deps);
+        else
+            errors[i] = toString(deps.takeError());
+    });
 
-using namespace llvm;
+    // 按输入顺序输出, 与并行度无关
+    int ret = 0;
+    json::Array array;
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        if (!errors[i].empty())
+        {
+            errs() << jobs[i].file << ": " << errors[i] << "\n";
+            ret = 1;
+            continue;
+        }
+        if (opts.depsFormat == "make")
+        {
+            outs() << results[i];
+            continue;
+        }
+        std::string target;
+        std::vector<std::string> deps;
+        if (!parseMakeDeps(results[i], target, deps))
+        {
+            errs() << jobs[i].file << ": unexpected dependency output\n";
+            ret = 1;
+            continue;
+        }
+        json::Array depArray;
+        for (std::string &dep : deps)
+            depArray.push_back(std::move(dep));
+        array.push_back(json::Object{{"file", jobs[i].file}, {"target", target}, {"deps", std::move(depArray)}});
+    }
+    if (opts.depsFormat == "json")
+        outs() << formatv("{0:2}", json::Value(std::move(array))) << "\n";
 
-int main(int argc, char **argv)
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    errs() << "scanned " << jobs.size() << " files in " << format("%.1f", ms) << " ms with " << workers << " threads\n";
+    return ret;
+}
+
+/// 比较依赖扫描和用clang_parseTranslationUnit完整解析再用clang_getInclusions取依赖的耗时, 都在单线程中逐个处理
+static int benchDeps(const Options &opts)
 {
-    if (argc < 3)
+    using namespace clang::tooling::dependencies;
+
+    std::vector<ScanJob> jobs;
+    if (!collectScanJobs(opts, jobs))
+        return 1;
+    if (jobs.empty())
     {
-        std::cout << "Usage: " << std::endl;
-        std::cout << "    --emit-sema c语言文件名" << std::endl;
-        std::cout << "    --emit-tokens c语言文件名" << std::endl;
-        std::cout << "    --emit-ast c语言文件名" << std::endl;
-        std::cout << "    --emit-ir c语言文件名" << std::endl;
-        return 0;
+        std::cerr << "--bench-deps needs at least one c file or a compile database." << std::endl;
+        return 1;
     }
+
+    DependencyScanningService service(ScanningMode::MinimizedSourcePreprocessing, ScanningOutputFormat::Make);
+    DependencyScanningTool tool(service);
+    auto scanMs = [&](const ScanJob &job, size_t &deps) {
+        auto start = std::chrono::steady_clock::now();
+        Expected<std::string> result = tool.getDependencyFile(job.commandLine, job.directory);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::string target;
+        std::vector<std::string> depList;
+        if (!result)
+            errs() << job.file << ": " << toString(result.takeError()) << "\n";
+        else if (parseMakeDeps(*result, target, depList))
+            deps = depList.size();
+        return ms;
+    };
+
     CXIndex index = clang_createIndex(0, 0);
+    auto parseMs = [&](const ScanJob &job, size_t &deps) {
+        // 编译命令去掉编译器本身, 在编译命令的目录中解析
+        std::vector<const char *> args = {"-working-directory", job.directory.c_str()};
+        for (size_t i = 1; i < job.commandLine.size(); ++i)
+            args.push_back(job.commandLine[i].c_str());
+        auto start = std::chrono::steady_clock::now();
+        CXTranslationUnit translationUnit = clang_parseTranslationUnit(
+            index, nullptr, args.data(), args.size(), nullptr, 0, CXTranslationUnit_None);
+        std::vector<std::string> files;
+        if (translationUnit)
+            clang_getInclusions(
+                translationUnit,
+                [](CXFile includedFile, CXSourceLocation *, unsigned, CXClientData clientData) {
+                    CXString name = clang_getFileName(includedFile);
+                    static_cast<std::vector<std::string> *>(clientData)->push_back(clang_getCString(name));
+                    clang_disposeString(name);
+                },
+                &files);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (!translationUnit)
+            errs() << job.file << ": clang_parseTranslationUnit failed\n";
+        clang_disposeTranslationUnit(translationUnit);
+        deps = files.size();
+        return ms;
+    };
+
+    // 第一个文件先各跑一遍, 不把动态库和系统头文件第一次读入的时间算进去
+    size_t ignored;
+    scanMs(jobs[0], ignored);
+    parseMs(jobs[0], ignored);
+
+    double totalScan = 0, totalParse = 0;
+    outs() << format("%-40s %14s %18s %10s\n", "file", "scan-deps", "parseTranslationUnit", "deps");
+    for (const ScanJob &job : jobs)
+    {
+        size_t scanDepCount = 0, parseDepCount = 0;
+        double scan = scanMs(job, scanDepCount);
+        double parse = parseMs(job, parseDepCount);
+        totalScan += scan;
+        totalParse += parse;
+        outs() << format("%-40s %11.2f ms %15.2f ms %4zu/%-4zu\n", job.file.c_str(), scan, parse, scanDepCount,
+                         parseDepCount);
+    }
+    outs() << format("%-40s %11.2f ms %15.2f ms\n", "total", totalScan, totalParse);
+    if (totalScan > 0)
+        outs() << format("scan-deps is %.1fx faster\n", totalParse / totalScan);
+    clang_disposeIndex(index);
+    return 0;
+}
+
+/// libclang的驱动选择的目标和语言选项(默认cpu、PIC级别等)与mcc直接给cc1的参数不同, 而加载PCH时这些选项必须一致,
+/// 所以libclang模式使用单独生成的PCH: prelude.h.pch对应prelude.h.libclang.pch
+static std::string libclangPCHPath(StringRef pch)
+{
+    if (pch.empty())
+        return "";
+    if (pch.consume_back(".pch"))
+        return (pch + ".libclang.pch").str();
+    return (pch + ".libclang").str();
+}
 
-    std::ifstream in_file(argv[2], std::ios::binary);
-    in_file.seekg(0, std::ios::end);
-    int file_size = in_file.tellg();
+/// 为头文件生成两份PCH: 头文件.pch供CompilerInstance使用, 头文件.libclang.pch供libclang使用
+static int buildPCH(const Options &opts, const std::string &header)
+{
+    auto start = std::chrono::steady_clock::now();
+    Options pchOpts = opts;
+    pchOpts.mode = "--build-pch";
+    pchOpts.includePCH.clear();
+    clang::GeneratePCHAction action;
+    if (!runFrontendAction(pchOpts, header, action))
+    {
+        std::puts("Failed to run GeneratePCHAction!");
+        return 1;
+    }
 
-    // Parse the source file into a translation unit
+    // 与c-index-test -write-pch相同: 不完整的翻译单元保存下来就是PCH
+    std::string libclangPath = libclangPCHPath(header + ".pch");
+    CXIndex index = clang_createIndex(0, 0);
+    const char *args[] = {"-x", "c-header"};
     CXTranslationUnit translationUnit = clang_parseTranslationUnit(
-        index,
-        argv[2],                 // Assume the name of the file is example.c
-        nullptr, 0,              // Command line args and number of args
-        nullptr, 0,              // Unsaved files and number of unsaved files
-        CXTranslationUnit_None); // Options
+        index, header.c_str(), args, 2, nullptr, 0,
+        CXTranslationUnit_Incomplete | CXTranslationUnit_ForSerialization);
+    int ret = 0;
+    if (translationUnit == nullptr ||
+        clang_saveTranslationUnit(translationUnit, libclangPath.c_str(), clang_defaultSaveOptions(translationUnit)) != CXSaveError_None)
+    {
+        std::cerr << "Unable to write " << libclangPath << std::endl;
+        ret = 1;
+    }
+    if (translationUnit)
+        clang_disposeTranslationUnit(translationUnit);
+    clang_disposeIndex(index);
+
+    // 文件缓存可能已经记下了PCH不存在或旧的内容, 本进程之后的翻译单元要看到新的PCH
+    sharedFileCache().invalidate(header + ".pch");
+    sharedFileCache().invalidate(libclangPath);
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    errs() << header << ".pch, " << libclangPath << ": built in " << format("%.1f", ms) << " ms\n";
+    return ret;
+}
+
+/// 比较每个文件使用和不使用PCH时的前端(-fsyntax-only)耗时
+///
+/// 第一个输入是头文件, 其余是c文件. 不使用PCH时以-include包含头文件, 两种情况下源码的语义相同.
+/// 正式计时前先不计时地处理一次第一个文件, 两种情况下系统头文件都已经在文件缓存中.
+static int benchPCH(const Options &opts)
+{
+    if (opts.inputs.size() < 2)
+    {
+        std::cerr << "--bench-pch needs a header and at least one c file." << std::endl;
+        return 1;
+    }
+    const std::string &header = opts.inputs[0];
+    if (int ret = buildPCH(opts, header))
+        return ret;
+
+    Options withoutPCH = opts;
+    withoutPCH.forceInclude = header;
+    Options withPCH = opts;
+    withPCH.includePCH = header + ".pch";
+
+    auto frontendMs = [](const Options &runOpts, const std::string &file) {
+        auto start = std::chrono::steady_clock::now();
+        clang::SyntaxOnlyAction action;
+        runFrontendAction(runOpts, file, action);
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    frontendMs(withoutPCH, opts.inputs[1]);
+    frontendMs(withPCH, opts.inputs[1]);
+
+    double totalWithout = 0, totalWith = 0;
+    outs() << format("%-40s %14s %14s\n", "file", "without PCH", "with PCH");
+    for (size_t i = 1; i < opts.inputs.size(); ++i)
+    {
+        double without = frontendMs(withoutPCH, opts.inputs[i]);
+        double with = frontendMs(withPCH, opts.inputs[i]);
+        totalWithout += without;
+        totalWith += with;
+        outs() << format("%-40s %11.2f ms %11.2f ms\n", opts.inputs[i].c_str(), without, with);
+    }
+    outs() << format("%-40s %11.2f ms %11.2f ms\n", "total", totalWithout, totalWith);
+    return 0;
+}
+
+/// 把每条诊断格式化成--emit-sema打印的一行
+static std::vector<std::string> formatDiagnostics(CXTranslationUnit translationUnit)
+{
+    std::vector<std::string> lines;
+    unsigned diagnosticCount = clang_getNumDiagnostics(translationUnit);
+    for (unsigned i = 0; i < diagnosticCount; ++i)
+    {
+        CXDiagnostic diagnostic = clang_getDiagnostic(translationUnit, i);
+        CXString category = clang_getDiagnosticCategoryText(diagnostic);
+        CXString message = clang_getDiagnosticSpelling(diagnostic);
+        int severity = clang_getDiagnosticSeverity(diagnostic);
+        CXSourceLocation loc = clang_getDiagnosticLocation(diagnostic);
+        CXString fName;
+        unsigned line = 0, col = 0;
+        clang_getPresumedLocation(loc, &fName, &line, &col);
+        std::ostringstream os;
+        os << "Severity: " << severity << " File: "
+           << clang_getCString(fName) << " Line: "
+           << line << " Col: " << col << " Category: \""
+           << clang_getCString(category) << "\" Message: "
+           << clang_getCString(message);
+        lines.push_back(os.str());
+        clang_disposeString(fName);
+        clang_disposeString(message);
+        clang_disposeString(category);
+        clang_disposeDiagnostic(diagnostic);
+    }
+    return lines;
+}
+
+/// 语法树缓存: 解析好的翻译单元用clang_saveTranslationUnit写入缓存目录, 之后用clang_createTranslationUnit2直接加载
+///
+/// 缓存键是主文件的路径、内容和命令行参数的哈希. 同名的.deps.json记录解析时包含的每个文件的路径、大小和内容哈希,
+/// 以及--emit-sema要重放的诊断(保存的语法树中不含诊断). 任何一个被包含的文件变化或消失时都重新解析.
+/// 有错误的翻译单元不能保存, 每次都重新解析.
+class ASTCache
+{
+public:
+    ASTCache(const Options &opts, CXIndex index) : dir(opts.astCacheDir), index(index)
+    {
+        if (dir.empty())
+            return;
+        if (std::error_code ec = sys::fs::create_directories(dir))
+        {
+            errs() << dir << ": " << ec.message() << "\n";
+            dir.clear();
+        }
+    }
+
+    ~ASTCache()
+    {
+        if (dir.empty() || (loaded == 0 && parsed == 0))
+            return;
+        errs() << "AST cache: " << loaded << " loaded (" << format("%.1f", loadSeconds * 1000) << " ms), "
+               << parsed << " parsed (" << format("%.1f", parseSeconds * 1000) << " ms)\n";
+    }
+
+    /// 返回翻译单元, 命中缓存时直接加载, 否则解析并尽量写入缓存
+    CXTranslationUnit get(const std::string &file, const std::vector<const char *> &args,
+                          const std::vector<CXUnsavedFile> &unsavedFiles, std::vector<std::string> &diagnostics)
+    {
+        // 内存中的文件在磁盘上不存在, 加载语法树时无法校验, 不使用缓存
+        bool cacheable = !dir.empty() && unsavedFiles.empty();
+        std::string key = cacheable ? cacheKey(file, args) : "";
+        auto start = std::chrono::steady_clock::now();
+        if (!key.empty())
+        {
+            if (CXTranslationUnit translationUnit = load(key, diagnostics))
+            {
+                ++loaded;
+                loadSeconds += elapsedSeconds(start);
+                return translationUnit;
+            }
+        }
+
+        // Parse the source file into a translation unit
+        CXTranslationUnit translationUnit = clang_parseTranslationUnit(
+            index,
+            file.c_str(),
+            args.data(), args.size(),
+            const_cast<CXUnsavedFile *>(unsavedFiles.data()), unsavedFiles.size(),
+            key.empty() ? CXTranslationUnit_None : CXTranslationUnit_ForSerialization);
+        if (translationUnit == nullptr)
+            return nullptr;
+        diagnostics = formatDiagnostics(translationUnit);
+        if (!key.empty())
+        {
+            // 写缓存的时间不算在解析时间里
+            ++parsed;
+            parseSeconds += elapsedSeconds(start);
+            store(key, translationUnit, args, diagnostics);
+        }
+        return translationUnit;
+    }
+
+private:
+    static double elapsedSeconds(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    static std::string contentHash(StringRef contents)
+    {
+        return utohexstr(xxHash64(contents));
+    }
+
+    /// 主文件读不到时返回空串, 不使用缓存
+    std::string cacheKey(const std::string &file, const std::vector<const char *> &args)
+    {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = sharedFileCache().vfs()->getBufferForFile(file);
+        if (!buffer)
+            return "";
+        SmallString<256> path(file);
+        sys::fs::make_absolute(path);
+
+        MD5 hash;
+        CXString version = clang_getClangVersion();
+        hash.update(clang_getCString(version));
+        clang_disposeString(version);
+        hash.update(StringRef(path.c_str(), path.size() + 1));
+        for (const char *arg : args)
+            hash.update(StringRef(arg, std::strlen(arg) + 1));
+        hash.update((*buffer)->getBuffer());
+        MD5::MD5Result result;
+        hash.final(result);
+        return std::string(result.digest());
+    }
+
+    std::string entryPath(StringRef key, StringRef extension)
+    {
+        SmallString<256> path(dir);
+        sys::path::append(path, key + extension);
+        return std::string(path);
+    }
 
+    /// 所有被包含的文件大小和内容都与记录一致时才加载语法树
+    CXTranslationUnit load(StringRef key, std::vector<std::string> &diagnostics)
+    {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> sidecar = MemoryBuffer::getFile(entryPath(key, ".deps.json"));
+        if (!sidecar)
+            return nullptr;
+        Expected<json::Value> parsed = json::parse((*sidecar)->getBuffer());
+        if (!parsed)
+        {
+            consumeError(parsed.takeError());
+            return nullptr;
+        }
+        const json::Object *root = parsed->getAsObject();
+        const json::Array *deps = root ? root->getArray("deps") : nullptr;
+        const json::Array *diags = root ? root->getArray("diagnostics") : nullptr;
+        if (!deps || !diags)
+            return nullptr;
+
+        for (const json::Value &value : *deps)
+        {
+            const json::Object *dep = value.getAsObject();
+            auto path = dep ? dep->getString("path") : None;
+            auto size = dep ? dep->getInteger("size") : None;
+            auto hash = dep ? dep->getString("hash") : None;
+            if (!path || !size || !hash)
+                return nullptr;
+            // 先比较大小, 大小相同再比较内容哈希, 不依赖修改时间
+            ErrorOr<vfs::Status> status = sharedFileCache().vfs()->status(*path);
+            if (!status || status->getSize() != static_cast<uint64_t>(*size))
+                return nullptr;
+            ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = sharedFileCache().vfs()->getBufferForFile(*path);
+            if (!buffer || contentHash((*buffer)->getBuffer()) != *hash)
+                return nullptr;
+        }
+
+        CXTranslationUnit translationUnit = nullptr;
+        if (clang_createTranslationUnit2(index, entryPath(key, ".ast").c_str(), &translationUnit) != CXError_Success)
+            return nullptr;
+        diagnostics.clear();
+        for (const json::Value &value : *diags)
+        {
+            if (auto line = value.getAsString())
+                diagnostics.push_back(line->str());
+        }
+        return translationUnit;
+    }
+
+    static void collectInclusion(CXFile includedFile, CXSourceLocation *, unsigned, CXClientData clientData)
+    {
+        CXString name = clang_getFileName(includedFile);
+        static_cast<std::vector<std::string> *>(clientData)->push_back(clang_getCString(name));
+        clang_disposeString(name);
+    }
+
+    void store(StringRef key, CXTranslationUnit translationUnit, const std::vector<const char *> &args,
+               const std::vector<std::string> &diagnostics)
+    {
+        std::vector<std::string> files;
+        clang_getInclusions(translationUnit, collectInclusion, &files);
+        // 使用的PCH本身也是依赖, 重新生成后要重新解析
+        for (size_t i = 0; i + 1 < args.size(); ++i)
+        {
+            if (StringRef(args[i]) == "-include-pch")
+                files.push_back(args[i + 1]);
+        }
+        json::Array deps;
+        for (std::string &path : files)
+        {
+            // 相对路径按当前目录展开, 从别的目录运行时也能正确校验
+            SmallString<256> absolute(path);
+            sys::fs::make_absolute(absolute);
+            path = std::string(absolute);
+            ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = sharedFileCache().vfs()->getBufferForFile(path);
+            if (!buffer)
+                return;
+            deps.push_back(json::Object{
+                {"path", path},
+                {"size", static_cast<int64_t>((*buffer)->getBufferSize())},
+                {"hash", contentHash((*buffer)->getBuffer())},
+            });
+        }
+        json::Array diags;
+        for (const std::string &line : diagnostics)
+            diags.push_back(line);
+
+        // 先写语法树再写.deps.json, 都是先写临时文件再改名; 只有.deps.json存在时才会去加载语法树
+        std::string astPath = entryPath(key, ".ast");
+        SmallString<256> tmp;
+        if (sys::fs::createUniqueFile(astPath + ".tmp%%%%%%", tmp))
+            return;
+        // 翻译单元有错误时保存失败, 这样的文件不缓存
+        if (clang_saveTranslationUnit(translationUnit, tmp.c_str(), clang_defaultSaveOptions(translationUnit)) != CXSaveError_None ||
+            sys::fs::rename(tmp, astPath))
+        {
+            sys::fs::remove(tmp);
+            return;
+        }
+
+        std::string depsPath = entryPath(key, ".deps.json");
+        int fd;
+        if (sys::fs::createUniqueFile(depsPath + ".tmp%%%%%%", fd, tmp))
+            return;
+        {
+            raw_fd_ostream os(fd, true /* shouldClose */);
+            os << json::Value(json::Object{{"deps", std::move(deps)}, {"diagnostics", std::move(diags)}});
+        }
+        if (sys::fs::rename(tmp, depsPath))
+            sys::fs::remove(tmp);
+    }
+
+    std::string dir;
+    CXIndex index;
+    unsigned loaded = 0;
+    unsigned parsed = 0;
+    double loadSeconds = 0;
+    double parseSeconds = 0;
+};
+
+/// 用libclang处理一个c文件: 打印语义检查信息、词法符号或语法树
+///
+/// 批量处理时所有文件共用同一个CXIndex, 使用--ast-cache时解析结果可以跨进程复用
+static void runLibclang(const Options &opts, ASTCache &astCache, const std::string &file)
+{
+    // 文件可能只存在于内存中, 通过共享文件缓存获取大小
+    ErrorOr<vfs::Status> status = sharedFileCache().vfs()->status(file);
+    int file_size = status ? status->getSize() : 0;
+
+    // libclang不能接入我们的文件系统, 内存中的文件以unsaved file的形式传入
+    std::vector<std::pair<std::string, std::string>> memFiles = sharedFileCache().inMemoryFiles();
+    std::vector<CXUnsavedFile> unsavedFiles;
+    for (const auto &memFile : memFiles)
+        unsavedFiles.push_back({memFile.first.c_str(), memFile.second.data(),
+                                static_cast<unsigned long>(memFile.second.size())});
+
+    std::vector<const char *> args;
+    std::string pchPath = libclangPCHPath(opts.includePCH);
+    if (!pchPath.empty())
+    {
+        args.push_back("-include-pch");
+        args.push_back(pchPath.c_str());
+    }
+    std::vector<std::string> diagnostics;
+    CXTranslationUnit translationUnit = astCache.get(file, args, unsavedFiles, diagnostics);
     if (translationUnit == nullptr)
     {
         std::cerr << "Unable to parse translation unit. Quitting." << std::endl;
         exit(-1);
     }
 
-    if (strcmp(argv[1], "--emit-sema") == 0)
+    if (opts.memReport)
+    {
+        MemoryReport report;
+        CXTUResourceUsage usage = clang_getCXTUResourceUsage(translationUnit);
+        for (unsigned i = 0; i < usage.numEntries; ++i)
+            report.addBytes(clang_getTUResourceUsageName(usage.entries[i].kind), usage.entries[i].amount);
+        clang_disposeCXTUResourceUsage(usage);
+        report.addBytes("RSS after parsing", currentRSSBytes());
+        report.print(file);
+    }
+
+    if (opts.mode == "--emit-sema")
     {
         /// 如果有语义分析错误，打印错误
-        unsigned diagnosticCount = clang_getNumDiagnostics(translationUnit);
-        for (unsigned i = 0; i < diagnosticCount; ++i)
-        {
-            CXDiagnostic diagnostic = clang_getDiagnostic(translationUnit, i);
-            CXString category = clang_getDiagnosticCategoryText(diagnostic);
-            CXString message = clang_getDiagnosticSpelling(diagnostic);
-            int severity = clang_getDiagnosticSeverity(diagnostic);
-            CXSourceLocation loc = clang_getDiagnosticLocation(diagnostic);
-            CXString fName;
-            unsigned line = 0, col = 0;
-            clang_getPresumedLocation(loc, &fName, &line, &col);
-            std::cout << "Severity: " << severity << " File: "
-                      << clang_getCString(fName) << " Line: "
-                      << line << " Col: " << col << " Category: \""
-                      << clang_getCString(category) << "\" Message: "
-                      << clang_getCString(message) << std::endl;
-            clang_disposeString(fName);
-            clang_disposeString(message);
-            clang_disposeString(category);
-            clang_disposeDiagnostic(diagnostic);
-        }
+        for (const std::string &line : diagnostics)
+            std::cout << line << std::endl;
         std::cout << std::endl;
     }
 
     // 词法分析
-    if (strcmp(argv[1], "--emit-tokens") == 0)
+    if (opts.mode == "--emit-tokens")
     {
-        CXFile file = clang_getFile(translationUnit, argv[2]);
+        CXFile mainFile = clang_getFile(translationUnit, file.c_str());
         unsigned int line;
         unsigned int column;
         unsigned int offset;
         CXSourceLocation loc_start =
-            clang_getLocationForOffset(translationUnit, file, 0);
+            clang_getLocationForOffset(translationUnit, mainFile, 0);
         CXSourceLocation loc_end =
-            clang_getLocationForOffset(translationUnit, file, file_size);
+            clang_getLocationForOffset(translationUnit, mainFile, file_size);
         CXSourceRange range = clang_getRange(loc_start, loc_end);
         unsigned numTokens = 0;
         CXToken *tokens = NULL;
@@ -131,7 +2729,7 @@ int main(int argc, char **argv)
             enum CXTokenKind kind = clang_getTokenKind(tokens[i]);
             CXString name = clang_getTokenSpelling(translationUnit, tokens[i]);
             CXSourceLocation loc = clang_getTokenLocation(translationUnit, tokens[i]);
-            clang_getFileLocation(loc, &file, &line, &column, &offset);
+            clang_getFileLocation(loc, &mainFile, &line, &column, &offset);
             std::cout << "line number " << line << ": ";
             switch (kind)
             {
@@ -160,103 +2758,94 @@ int main(int argc, char **argv)
     // Visit all the nodes in the AST starting from the root cursor
     // Get the root cursor of the translation unit
     // 打印AST语法分析树
-    if (strcmp(argv[1], "--emit-ast") == 0)
+    if (opts.mode == "--emit-ast")
     {
         CXCursor rootCursor = clang_getTranslationUnitCursor(translationUnit);
         unsigned int depth = 0;
         clang_visitChildren(rootCursor, prettyPrintAst, &depth);
     }
 
-    // Clean up
     clang_disposeTranslationUnit(translationUnit);
-    clang_disposeIndex(index);
+}
 
-    if (strcmp(argv[1], "--emit-ir") == 0)
-    {
-
-        /// 生成llvm ir
-        // Setup custom diagnostic options.
-        IntrusiveRefCntPtr<clang::DiagnosticOptions> diag_opts(new clang::DiagnosticOptions());
-        diag_opts->ShowColors = 1;
-
-        // Setup custom diagnostic consumer.
-        //
-        // We configure the consumer with our custom diagnostic options and set it
-        // up that diagnostic messages are printed to stderr.
-        std::unique_ptr<clang::DiagnosticConsumer> diag_print =
-            std::make_unique<clang::TextDiagnosticPrinter>(llvm::errs(), diag_opts.get());
-
-        // Create custom diagnostics engine.
-        //
-        // The engine will NOT take ownership of the DiagnosticConsumer object.
-        auto diag_eng = std::make_unique<clang::DiagnosticsEngine>(
-            nullptr /* DiagnosticIDs */, diag_opts, diag_print.get(),
-            false /* own DiagnosticConsumer */);
-
-        // Create compiler instance.
-        clang::CompilerInstance cc;
-
-        // Setup compiler invocation.
-        //
-        // We are only passing a single argument, which is the pseudo file name for
-        // our code `code_fname`. We will be remapping this pseudo file name to an
-        // in-memory buffer via the preprocessor options below.
-        //
-        // The CompilerInvocation is a helper class which holds the data describing
-        // a compiler invocation (eg include paths, code generation options,
-        // warning flags, ..).
-        if (!clang::CompilerInvocation::CreateFromArgs(cc.getInvocation(),
-                                                       ArrayRef<const char *>({argv[2]}),
-                                                       *diag_eng))
-        {
-            std::puts("Failed to create CompilerInvocation!");
-            return 1;
-        }
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        printUsage();
+        return 0;
+    }
+
+    Options opts;
+    if (!parseOptions(argc, argv, opts))
+        return 1;
 
-        // Setup a TextDiagnosticPrinter printer with our diagnostic options to
-        // handle diagnostic messaged.
-        //
-        // The compiler will NOT take ownership of the DiagnosticConsumer object.
-        cc.createDiagnostics(diag_print.get(), false /* own DiagnosticConsumer */);
-
-        // Create in-memory readonly buffer with pointing to our C code.
-        std::ifstream t(argv[2]);
-        t.seekg(0, std::ios::end);
-        size_t size = t.tellg();
-        std::string code_input(size, ' ');
-        t.seekg(0);
-        t.read(&code_input[0], size);
-        std::unique_ptr<MemoryBuffer> code_buffer =
-            MemoryBuffer::getMemBuffer(code_input);
-        // Configure remapping from pseudo file name to in-memory code buffer
-        // code_fname -> code_buffer.
-        //
-        // Ownership of the MemoryBuffer object is moved, except we would set
-        // `RetainRemappedFileBuffers = 1` in the PreprocessorOptions.
-        cc.getPreprocessorOpts().addRemappedFile(argv[2], code_buffer.release());
-
-        // Create action to generate LLVM IR.
-        //
-        // If created with default arguments, the EmitLLVMOnlyAction will allocate
-        // an owned LLVMContext and free it once the action goes out of scope.
-        //
-        // To keep the context after the action goes out of scope, either pass a
-        // LLVMContext (borrowed) when creating the EmitLLVMOnlyAction or call
-        // takeLLVMContext() to move ownership out of the action.
-        clang::EmitLLVMOnlyAction action;
-        // Run action against our compiler instance.
-        if (!cc.ExecuteAction(action))
-        {
-            std::puts("Failed to run EmitLLVMOnlyAction!");
+    // clang的后端和ThinLTO都需要本机目标来创建TargetMachine
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    // 从标准输入读取的源码只放在内存文件系统中, 不落盘
+    for (std::string &file : opts.inputs)
+    {
+        if (file != "-")
+            continue;
+        ErrorOr<std::unique_ptr<MemoryBuffer>> input = MemoryBuffer::getSTDIN();
+        if (!input)
+        {
+            std::cerr << "Unable to read stdin: " << input.getError().message() << std::endl;
             return 1;
         }
+        file = "stdin.c";
+        sharedFileCache().addFile(file, (*input)->getBuffer());
+    }
 
-        // Take generated LLVM IR module and print to stdout.
-        if (auto mod = action.takeModule())
+    int ret = 0;
+    if (opts.mode == "--thinlto-link")
+        ret = thinLTOLink(opts);
+    else if (opts.mode == "--scan-deps")
+        ret = scanDeps(opts);
+    else if (opts.mode == "--bench-deps")
+        ret = benchDeps(opts);
+    else if (opts.mode == "--check")
+        ret = checkFiles(opts);
+    else if (opts.mode == "--build-pch")
+    {
+        for (const std::string &header : opts.inputs)
+        {
+            if ((ret = buildPCH(opts, header)) != 0)
+                break;
+        }
+    }
+    else if (opts.mode == "--bench-pch")
+        ret = benchPCH(opts);
+    else if (opts.mode == "--emit-ir" || opts.mode == "--emit-bc")
+    {
+        PassMetrics metrics(opts);
+        for (const std::string &file : opts.inputs)
+        {
+            metrics.begin();
+            ret = opts.mode == "--emit-ir" ? emitIR(opts, file) : emitBitcode(opts, file);
+            metrics.end(file);
+            if (ret != 0)
+                break;
+        }
+        metrics.finish();
+    }
+    else
+    {
+        CXIndex index = clang_createIndex(0, 0);
         {
-            mod->print(llvm::outs(), nullptr);
+            ASTCache astCache(opts, index);
+            for (const std::string &file : opts.inputs)
+                runLibclang(opts, astCache, file);
         }
+        clang_disposeIndex(index);
     }
 
-    return 0;
+    if (opts.vfsStats)
+        sharedFileCache().printStats(errs());
+    if (opts.memReport)
+        errs() << format("peak RSS of the process: %.1f MB\n", peakRSSBytes() / 1048576.0);
+    return ret;
 }
@@ -0,0 +1,355 @@
+#pragma once
+
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/FileSystemOptions.h>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/VirtualFileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+
+/// 在多个翻译单元之间共享的文件系统缓存
+///
+/// 文件系统分三层:
+///   1. 真实文件系统
+///   2. 内存文件系统, 存放生成的源文件和头文件, 不需要落盘
+///   3. 缓存层, 记住每个路径的stat结果(包括不存在的路径)和文件内容
+///
+/// 所有翻译单元共用同一个FileManager, stdio.h这类系统头文件在整个批次中只会被stat和读取一次.
+/// 缓存不会自动发现磁盘上的修改, 文件变化后需要调用invalidate().
+class SharedFileCache
+{
+public:
+    struct Stats
+    {
+        uint64_t statRequests = 0;
+        uint64_t statsSaved = 0;
+        uint64_t opens = 0;
+        uint64_t bytesRead = 0;
+        uint64_t bytesSaved = 0;
+    };
+
+    SharedFileCache()
+    {
+        memFS = new MemoryFileSystem(llvm::vfs::getRealFileSystem());
+        cachingFS = new CachingFileSystem(memFS);
+        resetFileManager();
+    }
+
+    /// 所有翻译单元共用的FileManager. FileManager本身不是线程安全的, 并行编译时每个线程应使用vfs()创建自己的FileManager
+    clang::FileManager &fileManager() { return *fileMgr; }
+
+    /// 带缓存的文件系统, 线程安全
+    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs() { return cachingFS; }
+
+    /// 在内存中添加(或替换)一个文件, 之后所有翻译单元都能以path包含或编译它
+    void addFile(llvm::StringRef path, llvm::StringRef contents)
+    {
+        memFS->addFile(path, contents);
+        invalidate(path);
+    }
+
+    /// 通过addFile添加的文件, 路径和内容
+    std::vector<std::pair<std::string, std::string>> inMemoryFiles() { return memFS->files(); }
+
+    /// 丢弃一个路径的缓存, 下一次访问会重新stat和读取
+    void invalidate(llvm::StringRef path)
+    {
+        cachingFS->invalidate(path);
+        resetFileManager();
+    }
+
+    /// 丢弃所有缓存
+    void invalidateAll()
+    {
+        cachingFS->invalidateAll();
+        resetFileManager();
+    }
+
+    Stats stats() const { return cachingFS->stats(); }
+
+    void printStats(llvm::raw_ostream &os) const
+    {
+        Stats s = stats();
+        os << "file cache: " << s.statRequests << " stats (" << s.statsSaved << " saved), "
+           << s.opens << " opens, " << s.bytesRead << " bytes read, "
+           << s.bytesSaved << " bytes not re-read\n";
+    }
+
+private:
+    /// 缓存的文件内容可能在翻译单元仍在使用时被invalidate, 用shared_ptr保证buffer活到最后一个使用者
+    class SharedBuffer : public llvm::MemoryBuffer
+    {
+    public:
+        SharedBuffer(std::shared_ptr<llvm::MemoryBuffer> owner, bool requiresNullTerminator)
+            : owner(std::move(owner))
+        {
+            init(this->owner->getBufferStart(), this->owner->getBufferEnd(), requiresNullTerminator);
+        }
+
+        BufferKind getBufferKind() const override { return owner->getBufferKind(); }
+        llvm::StringRef getBufferIdentifier() const override { return owner->getBufferIdentifier(); }
+
+    private:
+        std::shared_ptr<llvm::MemoryBuffer> owner;
+    };
+
+    class CachedFile : public llvm::vfs::File
+    {
+    public:
+        CachedFile(llvm::vfs::Status status, std::shared_ptr<llvm::MemoryBuffer> buffer)
+            : stat(std::move(status)), buffer(std::move(buffer)) {}
+
+        llvm::ErrorOr<llvm::vfs::Status> status() override { return stat; }
+
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+        getBuffer(const llvm::Twine &, int64_t, bool requiresNullTerminator, bool) override
+        {
+            return std::unique_ptr<llvm::MemoryBuffer>(
+                std::make_unique<SharedBuffer>(buffer, requiresNullTerminator));
+        }
+
+        std::error_code close() override { return {}; }
+
+    private:
+        llvm::vfs::Status stat;
+        std::shared_ptr<llvm::MemoryBuffer> buffer;
+    };
+
+    /// 内存中的文件放在真实文件系统之上. 只有一层, 替换文件时原地换掉内容,
+    /// 读写共用一把读写锁, 其它线程正在编译时也可以添加文件
+    class MemoryFileSystem : public llvm::vfs::ProxyFileSystem
+    {
+    public:
+        explicit MemoryFileSystem(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs)
+            : ProxyFileSystem(std::move(fs)) {}
+
+        void addFile(llvm::StringRef path, llvm::StringRef contents)
+        {
+            std::string key = absolute(path);
+            // 每次替换都换一个新的UniqueID, FileManager不会把新内容当成已经读过的旧文件
+            MemoryFile file{path.str(), std::shared_ptr<llvm::MemoryBuffer>(
+                                            llvm::MemoryBuffer::getMemBufferCopy(contents, path)),
+                            llvm::vfs::getNextVirtualUniqueID()};
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            entries[key] = std::move(file);
+            // 父目录也要能stat到, 例如-I指向只存在于内存中的目录
+            for (llvm::StringRef dir = llvm::sys::path::parent_path(key); !dir.empty();
+                 dir = llvm::sys::path::parent_path(dir))
+            {
+                if (!directories.try_emplace(dir.str(), llvm::vfs::getNextVirtualUniqueID()).second)
+                    break;
+            }
+        }
+
+        std::vector<std::pair<std::string, std::string>> files()
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            std::vector<std::pair<std::string, std::string>> result;
+            for (const auto &entry : entries)
+                result.emplace_back(entry.second.name, entry.second.buffer->getBuffer().str());
+            return result;
+        }
+
+        llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &path) override
+        {
+            std::string key = absolute(path);
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex);
+                auto it = entries.find(key);
+                if (it != entries.end())
+                    return fileStatus(path, it->second);
+            }
+            llvm::ErrorOr<llvm::vfs::Status> result = ProxyFileSystem::status(path);
+            if (result)
+                return result;
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto dir = directories.find(key);
+            if (dir == directories.end())
+                return result;
+            return llvm::vfs::Status(path.str(), dir->second, llvm::sys::TimePoint<>(), 0, 0, 0,
+                                     llvm::sys::fs::file_type::directory_file, llvm::sys::fs::all_all);
+        }
+
+        llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(const llvm::Twine &path) override
+        {
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex);
+                auto it = entries.find(absolute(path));
+                if (it != entries.end())
+                    return std::unique_ptr<llvm::vfs::File>(
+                        std::make_unique<CachedFile>(fileStatus(path, it->second), it->second.buffer));
+            }
+            return ProxyFileSystem::openFileForRead(path);
+        }
+
+    private:
+        struct MemoryFile
+        {
+            std::string name;
+            std::shared_ptr<llvm::MemoryBuffer> buffer;
+            llvm::sys::fs::UniqueID id;
+        };
+
+        static llvm::vfs::Status fileStatus(const llvm::Twine &path, const MemoryFile &file)
+        {
+            return llvm::vfs::Status(path.str(), file.id, llvm::sys::TimePoint<>(), 0, 0,
+                                     file.buffer->getBufferSize(), llvm::sys::fs::file_type::regular_file,
+                                     llvm::sys::fs::all_all);
+        }
+
+        std::string absolute(const llvm::Twine &path) const
+        {
+            llvm::SmallString<256> result;
+            path.toVector(result);
+            if (!llvm::sys::path::is_absolute(result))
+                makeAbsolute(result);
+            llvm::sys::path::remove_dots(result);
+            return std::string(result);
+        }
+
+        std::shared_mutex mutex;
+        std::map<std::string, MemoryFile> entries;
+        std::map<std::string, llvm::sys::fs::UniqueID> directories;
+    };
+
+    class CachingFileSystem : public llvm::vfs::ProxyFileSystem
+    {
+    public:
+        explicit CachingFileSystem(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs)
+            : ProxyFileSystem(std::move(fs)) {}
+
+        llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &path) override
+        {
+            std::string key = cacheKey(path);
+            ++statRequests;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = statCache.find(key);
+                if (it != statCache.end())
+                {
+                    ++statsSaved;
+                    return renamed(it->second, path);
+                }
+            }
+            // 不存在的路径也要缓存, 头文件搜索产生的stat大部分都是这种
+            llvm::ErrorOr<llvm::vfs::Status> result = ProxyFileSystem::status(key);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                statCache.insert({key, result});
+            }
+            return renamed(result, path);
+        }
+
+        llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(const llvm::Twine &path) override
+        {
+            std::string key = cacheKey(path);
+            ++opens;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = contentCache.find(key);
+                if (it != contentCache.end())
+                {
+                    bytesSaved += it->second.second->getBufferSize();
+                    return std::unique_ptr<llvm::vfs::File>(std::make_unique<CachedFile>(
+                        llvm::vfs::Status::copyWithNewName(it->second.first, path), it->second.second));
+                }
+            }
+
+            auto file = ProxyFileSystem::openFileForRead(key);
+            if (!file)
+                return file.getError();
+            llvm::ErrorOr<llvm::vfs::Status> stat = (*file)->status();
+            if (!stat)
+                return stat.getError();
+            auto buffer = (*file)->getBuffer(key, stat->getSize(), true /* RequiresNullTerminator */, false);
+            if (!buffer)
+                return buffer.getError();
+            bytesRead += (*buffer)->getBufferSize();
+
+            std::shared_ptr<llvm::MemoryBuffer> shared = std::move(*buffer);
+            std::lock_guard<std::mutex> lock(mutex);
+            contentCache.insert({key, {*stat, shared}});
+            statCache.insert({key, *stat});
+            return std::unique_ptr<llvm::vfs::File>(
+                std::make_unique<CachedFile>(llvm::vfs::Status::copyWithNewName(*stat, path), shared));
+        }
+
+        void invalidate(llvm::StringRef path)
+        {
+            std::string key = cacheKey(path);
+            std::lock_guard<std::mutex> lock(mutex);
+            statCache.erase(key);
+            contentCache.erase(key);
+        }
+
+        void invalidateAll()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            statCache.clear();
+            contentCache.clear();
+        }
+
+        Stats stats() const
+        {
+            Stats s;
+            s.statRequests = statRequests;
+            s.statsSaved = statsSaved;
+            s.opens = opens;
+            s.bytesRead = bytesRead;
+            s.bytesSaved = bytesSaved;
+            return s;
+        }
+
+    private:
+        /// 缓存以绝对路径为键, 同一个相对路径在不同工作目录下指向不同的文件.
+        /// 绝对路径(系统头文件都是)不需要查询工作目录
+        std::string cacheKey(const llvm::Twine &path) const
+        {
+            llvm::SmallString<256> key;
+            path.toVector(key);
+            if (!llvm::sys::path::is_absolute(key))
+                makeAbsolute(key);
+            llvm::sys::path::remove_dots(key);
+            return std::string(key);
+        }
+
+        /// 返回的Status使用调用者给的路径, 与不经过缓存时一致
+        static llvm::ErrorOr<llvm::vfs::Status> renamed(const llvm::ErrorOr<llvm::vfs::Status> &status,
+                                                        const llvm::Twine &path)
+        {
+            if (!status)
+                return status.getError();
+            return llvm::vfs::Status::copyWithNewName(*status, path);
+        }
+
+        std::mutex mutex;
+        std::map<std::string, llvm::ErrorOr<llvm::vfs::Status>, std::less<>> statCache;
+        std::map<std::string, std::pair<llvm::vfs::Status, std::shared_ptr<llvm::MemoryBuffer>>, std::less<>> contentCache;
+        std::atomic<uint64_t> statRequests{0};
+        std::atomic<uint64_t> statsSaved{0};
+        std::atomic<uint64_t> opens{0};
+        std::atomic<uint64_t> bytesRead{0};
+        std::atomic<uint64_t> bytesSaved{0};
+    };
+
+    void resetFileManager()
+    {
+        // FileManager会记住已经查找过的路径(包括不存在的), 缓存失效后换一个新的FileManager,
+        // 大部分stat仍由cachingFS直接回答
+        fileMgr = new clang::FileManager(clang::FileSystemOptions(), cachingFS);
+    }
+
+    llvm::IntrusiveRefCntPtr<MemoryFileSystem> memFS;
+    llvm::IntrusiveRefCntPtr<CachingFileSystem> cachingFS;
+    llvm::IntrusiveRefCntPtr<clang::FileManager> fileMgr;
+};
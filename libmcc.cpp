@@ -0,0 +1,433 @@
+#include "mcc.h"
+
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/DiagnosticIDs.h>
+#include <clang/Basic/DiagnosticOptions.h>
+#include <clang/Basic/SourceManager.h>
+#include <clang/CodeGen/ModuleBuilder.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/FrontendAction.h>
+#include <clang/Lex/PreprocessorOptions.h>
+#include <clang/Serialization/InMemoryModuleCache.h>
+#include <clang/Serialization/PCHContainerOperations.h>
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+
+#include "file-cache.h"
+#include "system-includes.h"
+
+using namespace llvm;
+
+namespace mcc
+{
+
+namespace
+{
+
+/// 一个线程复用同一个LLVMContext的编译次数上限. LLVMContext会一直保留用过的类型和常量, 定期换一个新的
+constexpr unsigned contextReuseLimit = 256;
+
+/// 所有线程共用的文件缓存
+SharedFileCache &sharedFileCache()
+{
+    static SharedFileCache cache;
+    return cache;
+}
+
+/// 每次invalidate()加一. 线程发现与自己记录的值不同时换掉自己的FileManager和模块缓存
+std::atomic<uint64_t> cacheGeneration{0};
+/// SharedFileCache::invalidate会替换它自己的FileManager, 不能在多个线程中同时调用
+std::mutex invalidateMutex;
+
+void initializeTargets()
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        InitializeNativeTargetAsmParser();
+    });
+}
+
+/// 把诊断收集到CompileResult中
+class CollectingDiagnosticConsumer : public clang::DiagnosticConsumer
+{
+public:
+    explicit CollectingDiagnosticConsumer(std::vector<Diagnostic> &diagnostics) : diagnostics(diagnostics) {}
+
+    void HandleDiagnostic(clang::DiagnosticsEngine::Level level, const clang::Diagnostic &info) override
+    {
+        DiagnosticConsumer::HandleDiagnostic(level, info);
+        Diagnostic diagnostic;
+        switch (level)
+        {
+        case clang::DiagnosticsEngine::Ignored:
+            return;
+        case clang::DiagnosticsEngine::Note:
+            diagnostic.severity = Diagnostic::Note;
+            break;
+        case clang::DiagnosticsEngine::Remark:
+            diagnostic.severity = Diagnostic::Remark;
+            break;
+        case clang::DiagnosticsEngine::Warning:
+            diagnostic.severity = Diagnostic::Warning;
+            break;
+        case clang::DiagnosticsEngine::Error:
+            diagnostic.severity = Diagnostic::Error;
+            break;
+        case clang::DiagnosticsEngine::Fatal:
+            diagnostic.severity = Diagnostic::Fatal;
+            break;
+        }
+        if (info.hasSourceManager() && info.getLocation().isValid())
+        {
+            clang::PresumedLoc loc = info.getSourceManager().getPresumedLoc(info.getLocation());
+            if (loc.isValid())
+            {
+                diagnostic.file = loc.getFilename();
+                diagnostic.line = loc.getLine();
+                diagnostic.column = loc.getColumn();
+            }
+        }
+        SmallString<256> message;
+        info.FormatDiagnostic(message);
+        diagnostic.message = std::string(message);
+        diagnostics.push_back(std::move(diagnostic));
+    }
+
+private:
+    std::vector<Diagnostic> &diagnostics;
+};
+
+/// 直接用CodeGenerator生成模块, 在前端释放ASTContext之前取出模块
+class ModuleAction : public clang::ASTFrontendAction
+{
+public:
+    explicit ModuleAction(LLVMContext &context) : context(context) {}
+
+    std::unique_ptr<Module> takeModule() { return std::move(module); }
+
+protected:
+    std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &ci, StringRef file) override
+    {
+        std::unique_ptr<clang::CodeGenerator> result(clang::CreateLLVMCodeGen(
+            ci.getDiagnostics(), file, ci.getHeaderSearchOpts(), ci.getPreprocessorOpts(),
+            ci.getCodeGenOpts(), context));
+        gen = result.get();
+        return result;
+    }
+
+    void EndSourceFileAction() override
+    {
+        if (gen && !getCompilerInstance().getDiagnostics().hasErrorOccurred())
+            module.reset(gen->ReleaseModule());
+        gen = nullptr;
+    }
+
+private:
+    LLVMContext &context;
+    clang::CodeGenerator *gen = nullptr;
+    std::unique_ptr<Module> module;
+};
+
+/// 目标三元组、cpu和特性
+struct TargetSelection
+{
+    std::string triple;
+    std::string cpu;
+    std::vector<std::string> features;
+};
+
+TargetSelection selectTarget(StringRef cpu)
+{
+    TargetSelection target;
+    target.triple = sys::getDefaultTargetTriple();
+    if (cpu == "native")
+    {
+        // 本机的cpu和特性在进程内不会变, 只检测一次
+        static const TargetSelection host = [] {
+            TargetSelection host;
+            host.triple = sys::getProcessTriple();
+            host.cpu = sys::getHostCPUName().str();
+            StringMap<bool> hostFeatures;
+            if (sys::getHostCPUFeatures(hostFeatures))
+            {
+                for (const auto &feature : hostFeatures)
+                    host.features.push_back((feature.getValue() ? "+" : "-") + feature.getKey().str());
+                llvm::sort(host.features);
+            }
+            return host;
+        }();
+        return host;
+    }
+    target.cpu = cpu.str();
+    return target;
+}
+
+CodeGenOpt::Level codeGenOptLevel(unsigned optLevel)
+{
+    switch (optLevel)
+    {
+    case 0:
+        return CodeGenOpt::None;
+    case 1:
+        return CodeGenOpt::Less;
+    case 3:
+        return CodeGenOpt::Aggressive;
+    default:
+        return CodeGenOpt::Default;
+    }
+}
+
+OptimizationLevel optimizationLevel(unsigned optLevel)
+{
+    switch (optLevel)
+    {
+    case 0:
+        return OptimizationLevel::O0;
+    case 1:
+        return OptimizationLevel::O1;
+    case 3:
+        return OptimizationLevel::O3;
+    default:
+        return OptimizationLevel::O2;
+    }
+}
+
+/// 同一目标和优化级别的TargetMachine和优化流水线, 分析缓存在每次运行后清空
+struct Backend
+{
+    std::unique_ptr<TargetMachine> tm;
+    LoopAnalysisManager lam;
+    FunctionAnalysisManager fam;
+    CGSCCAnalysisManager cgam;
+    ModuleAnalysisManager mam;
+    std::unique_ptr<PassBuilder> pb;
+    ModulePassManager mpm;
+
+    Backend(const TargetSelection &target, unsigned optLevel, std::string &error)
+    {
+        const Target *theTarget = TargetRegistry::lookupTarget(target.triple, error);
+        if (!theTarget)
+            return;
+        tm.reset(theTarget->createTargetMachine(
+            target.triple, target.cpu, join(target.features, ","), TargetOptions(), Reloc::PIC_,
+            None, codeGenOptLevel(optLevel)));
+        if (!tm)
+            return;
+        pb = std::make_unique<PassBuilder>(tm.get());
+        pb->registerModuleAnalyses(mam);
+        pb->registerCGSCCAnalyses(cgam);
+        pb->registerFunctionAnalyses(fam);
+        pb->registerLoopAnalyses(lam);
+        pb->crossRegisterProxies(lam, fam, cgam, mam);
+        mpm = optLevel == 0 ? pb->buildO0DefaultPipeline(OptimizationLevel::O0)
+                            : pb->buildPerModuleDefaultPipeline(optimizationLevel(optLevel));
+    }
+
+    void optimize(Module &mod)
+    {
+        mpm.run(mod, mam);
+        // 分析结果引用了这个模块, 下一次编译之前必须清空
+        lam.clear();
+        fam.clear();
+        cgam.clear();
+        mam.clear();
+    }
+
+    bool emitObject(Module &mod, std::string &object)
+    {
+        SmallVector<char, 0> buffer;
+        raw_svector_ostream os(buffer);
+        legacy::PassManager pm;
+        if (tm->addPassesToEmitFile(pm, os, nullptr, CGFT_ObjectFile))
+            return false;
+        pm.run(mod);
+        object.assign(buffer.begin(), buffer.end());
+        return true;
+    }
+};
+
+/// 每个线程复用的编译状态
+///
+/// FileManager在多次编译之间保留头文件的查找结果, 主文件每次以新的内容重新映射, 与libclang重新解析时的做法相同.
+/// 这些对象都不是线程安全的, 所以每个线程一份.
+struct ThreadState
+{
+    IntrusiveRefCntPtr<clang::FileManager> fileManager;
+    IntrusiveRefCntPtr<clang::InMemoryModuleCache> moduleCache;
+    std::shared_ptr<clang::PCHContainerOperations> pchOps;
+    std::unique_ptr<LLVMContext> context;
+    unsigned contextUses = 0;
+    std::map<std::string, std::unique_ptr<Backend>> backends;
+
+    uint64_t generation = 0;
+
+    ThreadState()
+        : fileManager(new clang::FileManager(clang::FileSystemOptions(), sharedFileCache().vfs())),
+          moduleCache(new clang::InMemoryModuleCache()),
+          pchOps(std::make_shared<clang::PCHContainerOperations>()),
+          generation(cacheGeneration.load()) {}
+
+    /// FileManager记住了stat结果和文件内容, 模块缓存中的PCH可能由改动前的头文件生成, 文件缓存失效后都换新的
+    void refreshIfInvalidated()
+    {
+        uint64_t current = cacheGeneration.load();
+        if (current == generation)
+            return;
+        fileManager = new clang::FileManager(clang::FileSystemOptions(), sharedFileCache().vfs());
+        moduleCache = new clang::InMemoryModuleCache();
+        generation = current;
+    }
+
+    /// 不返回模块时使用线程自己的LLVMContext
+    LLVMContext &reusableContext()
+    {
+        if (!context || contextUses >= contextReuseLimit)
+        {
+            context = std::make_unique<LLVMContext>();
+            contextUses = 0;
+        }
+        ++contextUses;
+        return *context;
+    }
+
+    Backend *backend(const TargetSelection &target, unsigned optLevel, std::string &error)
+    {
+        std::string key = target.triple + "|" + target.cpu + "|" + join(target.features, ",") + "|" +
+                          std::to_string(optLevel);
+        std::unique_ptr<Backend> &entry = backends[key];
+        if (!entry)
+            entry = std::make_unique<Backend>(target, optLevel, error);
+        return entry->tm ? entry.get() : nullptr;
+    }
+};
+
+ThreadState &threadState()
+{
+    thread_local ThreadState state;
+    return state;
+}
+
+void addError(CompileResult &result, StringRef message)
+{
+    Diagnostic diagnostic;
+    diagnostic.severity = Diagnostic::Error;
+    diagnostic.message = message.str();
+    result.diagnostics.push_back(std::move(diagnostic));
+}
+
+} // namespace
+
+CompileResult compile(StringRef source, const CompileOptions &options)
+{
+    initializeTargets();
+    ThreadState &state = threadState();
+    state.refreshIfInvalidated();
+    CompileResult result;
+
+    IntrusiveRefCntPtr<clang::DiagnosticOptions> diagOpts(new clang::DiagnosticOptions());
+    CollectingDiagnosticConsumer consumer(result.diagnostics);
+    // 参数来自调用者, CreateFromArgs可能报告未知参数, 报告诊断需要DiagnosticIDs
+    clang::DiagnosticsEngine diagEngine(new clang::DiagnosticIDs(), diagOpts, &consumer,
+                                        false /* own DiagnosticConsumer */);
+
+    unsigned optLevel = std::min(options.optLevel, 3u);
+    TargetSelection target = selectTarget(options.cpu);
+    std::vector<std::string> args = {options.fileName, "-triple", target.triple};
+    if (!target.cpu.empty())
+    {
+        args.push_back("-target-cpu");
+        args.push_back(target.cpu);
+    }
+    for (const std::string &feature : target.features)
+    {
+        args.push_back("-target-feature");
+        args.push_back(feature);
+    }
+    if (optLevel > 0)
+        args.push_back("-O" + std::to_string(optLevel));
+    addSystemIncludes(target.triple, args);
+    args.insert(args.end(), options.args.begin(), options.args.end());
+    std::vector<const char *> argv;
+    for (const std::string &arg : args)
+        argv.push_back(arg.c_str());
+
+    clang::CompilerInstance cc(state.pchOps, state.moduleCache.get());
+    if (!clang::CompilerInvocation::CreateFromArgs(cc.getInvocation(), argv, diagEngine))
+        return result;
+    cc.createDiagnostics(&consumer, false /* own DiagnosticConsumer */);
+    cc.setFileManager(state.fileManager.get());
+
+    // 源码只在内存中, 映射到fileName. 缓冲区的所有权交给CompilerInstance
+    cc.getPreprocessorOpts().addRemappedFile(
+        options.fileName, MemoryBuffer::getMemBufferCopy(source, options.fileName).release());
+
+    std::unique_ptr<LLVMContext> ownContext;
+    if (options.emitModule)
+        ownContext = std::make_unique<LLVMContext>();
+    LLVMContext &context = ownContext ? *ownContext : state.reusableContext();
+
+    ModuleAction action(context);
+    if (!cc.ExecuteAction(action))
+        return result;
+    std::unique_ptr<Module> mod = action.takeModule();
+    if (!mod)
+        return result;
+
+    std::string error;
+    Backend *backend = state.backend(target, optLevel, error);
+    if (!backend)
+    {
+        addError(result, target.triple + ": " + error);
+        return result;
+    }
+    mod->setDataLayout(backend->tm->createDataLayout());
+    backend->optimize(*mod);
+
+    if (options.emitObject && !backend->emitObject(*mod, result.object))
+    {
+        addError(result, "target does not support emitting object files");
+        return result;
+    }
+
+    if (options.emitModule)
+    {
+        result.context = std::move(ownContext);
+        result.module = std::move(mod);
+    }
+    result.success = true;
+    return result;
+}
+
+void invalidate(StringRef path)
+{
+    {
+        std::lock_guard<std::mutex> lock(invalidateMutex);
+        sharedFileCache().invalidate(path);
+    }
+    // 先让共享缓存失效再增加代数, 线程换上的新FileManager一定看到失效后的缓存
+    ++cacheGeneration;
+}
+
+void invalidateAll()
+{
+    {
+        std::lock_guard<std::mutex> lock(invalidateMutex);
+        sharedFileCache().invalidateAll();
+    }
+    ++cacheGeneration;
+}
+
+} // namespace mcc
@@ -10,10 +10,15 @@
 #include <llvm/IR/IRPrintingPasses.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/MC/TargetRegistry.h>
 #include <llvm/Support/CodeGen.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/ToolOutputFile.h>
 #include <llvm/Support/raw_os_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
 
 using namespace llvm;
 
@@ -29,10 +34,37 @@ void addLLVMIdentMetadata(Module *module) {
     NMD->addOperand(Node);
 }
 
-Module *makeLLVMModule() {
+// 探测本机的cpu和特性(相当于-march=native)创建TargetMachine
+TargetMachine *createHostTargetMachine() {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+
+    std::string triple = sys::getProcessTriple();
+    std::string error;
+    const Target *target = TargetRegistry::lookupTarget(triple, error);
+    if (!target) {
+        errs() << error << '\n';
+        return nullptr;
+    }
+
+    std::string features;
+    StringMap<bool> hostFeatures;
+    if (sys::getHostCPUFeatures(hostFeatures)) {
+        for (const auto &feature : hostFeatures) {
+            if (!features.empty())
+                features += ",";
+            features += (feature.getValue() ? "+" : "-") + feature.getKey().str();
+        }
+    }
+    return target->createTargetMachine(triple, sys::getHostCPUName(), features,
+                                       TargetOptions(), Reloc::PIC_);
+}
+
+Module *makeLLVMModule(TargetMachine &targetMachine) {
     Module *module = new Module("min.c", TheContext);
-    module->setDataLayout("e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128");
-    module->setTargetTriple("x86_64-pc-linux-gnu");
+    // triple和data layout都从TargetMachine获得
+    module->setDataLayout(targetMachine.createDataLayout());
+    module->setTargetTriple(targetMachine.getTargetTriple().str());
     // experiment with module flags
     module->addModuleFlag(Module::ModFlagBehavior::Error, "wchar_size", 4);
     // experiment with module metadata (llvm.ident)
@@ -60,6 +92,8 @@ Module *makeLLVMModule() {
     funcMin->addFnAttr(Attribute::AttrKind::NoInline);
     funcMin->addFnAttr(Attribute::AttrKind::NoUnwind);
     funcMin->addFnAttr(Attribute::AttrKind::OptimizeNone);
+    funcMin->addFnAttr("target-cpu", targetMachine.getTargetCPU());
+    funcMin->addFnAttr("target-features", targetMachine.getTargetFeatureString());
 
     Function::arg_iterator args = funcMin->arg_begin();
     Value *int32_a = args++;
@@ -123,7 +157,11 @@ Module *makeLLVMModule() {
 }
 
 int main() {
-    auto module = makeLLVMModule();
+    std::unique_ptr<TargetMachine> targetMachine(createHostTargetMachine());
+    if (!targetMachine) {
+        return -1;
+    }
+    auto module = makeLLVMModule(*targetMachine);
     if (verifyModule(*module, &errs())) {
         return -1;
     }
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/// 可以嵌入到长期运行的服务中的c编译库
+///
+/// compile()可以在多个线程中同时调用. 每个线程复用自己的FileManager、模块缓存、TargetMachine、优化流水线和
+/// LLVMContext, 所有线程共用一个文件缓存, 系统头文件在整个进程中只会被stat和读取一次.
+/// 缓存不会自动发现磁盘上的修改, 文件变化后调用invalidate()或invalidateAll().
+/// 优化和代码生成由库自己的PassBuilder和TargetMachine完成, 不经过clang的BackendUtil, 不修改LLVM的全局命令行选项.
+namespace mcc
+{
+
+struct CompileOptions
+{
+    /// 诊断和调试信息中使用的文件名, 源码只在内存中, 不需要真的存在
+    std::string fileName = "input.c";
+    /// 优化级别, 0到3
+    unsigned optLevel = 0;
+    /// 目标cpu, 空表示默认的通用cpu, native表示本机cpu及其特性
+    std::string cpu;
+    /// 额外的cc1参数, 例如-I目录、-DNAME=1
+    std::vector<std::string> args;
+    /// 返回模块. 模块在自己的LLVMContext中, 调用者可以在任意线程使用
+    bool emitModule = true;
+    /// 生成目标文件
+    bool emitObject = false;
+};
+
+struct Diagnostic
+{
+    enum Severity
+    {
+        Note,
+        Remark,
+        Warning,
+        Error,
+        Fatal,
+    };
+    Severity severity;
+    std::string file;
+    unsigned line = 0;
+    unsigned column = 0;
+    std::string message;
+};
+
+struct CompileResult
+{
+    bool success = false;
+    /// 声明在module之前, 析构时先释放module
+    std::unique_ptr<llvm::LLVMContext> context;
+    std::unique_ptr<llvm::Module> module;
+    /// emitObject时的目标文件内容
+    std::string object;
+    std::vector<Diagnostic> diagnostics;
+};
+
+/// 编译一段c源码, 线程安全
+CompileResult compile(llvm::StringRef source, const CompileOptions &options = CompileOptions());
+
+/// 磁盘上的头文件改动后调用, 之后开始的compile()会重新stat和读取它. 正在进行的编译不受影响, 线程安全
+void invalidate(llvm::StringRef path);
+
+/// 丢弃所有缓存的stat结果和文件内容
+void invalidateAll();
+
+} // namespace mcc
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <llvm/ADT/Triple.h>
+
+#include <string>
+#include <vector>
+
+/// clang的资源目录, 其中的include是stddef.h、stdarg.h这些由编译器提供的头文件. 由Makefile从llvm-config得到
+#ifndef MCC_RESOURCE_DIR
+#error "MCC_RESOURCE_DIR must be set to the clang resource directory, e.g. $(llvm-config --libdir)/clang/$(llvm-config --version)"
+#endif
+
+/// cc1不会自己查找头文件目录, 像driver一样加上资源目录和系统头文件目录, 否则包含stdio.h时找不到stddef.h
+inline void addSystemIncludes(const std::string &triple, std::vector<std::string> &args)
+{
+    args.insert(args.end(), {"-resource-dir", MCC_RESOURCE_DIR,
+                             "-internal-isystem", MCC_RESOURCE_DIR "/include",
+                             "-internal-isystem", "/usr/local/include"});
+    llvm::Triple t(triple);
+    if (t.isOSLinux())
+    {
+        // Debian系发行版的多架构目录, 例如/usr/include/x86_64-linux-gnu, 不存在的目录会被忽略
+        args.push_back("-internal-externc-isystem");
+        args.push_back(("/usr/include/" + t.getArchName() + "-linux-gnu").str());
+    }
+    args.insert(args.end(), {"-internal-externc-isystem", "/include",
+                             "-internal-externc-isystem", "/usr/include"});
+}